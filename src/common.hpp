@@ -9,10 +9,14 @@
 #include <map>
 #include <span>
 #include <list>
+#include <deque>
 #include <mutex>
+#include <shared_mutex>
+#include <optional>
 #include <memory>
 #include <limits>
 #include <utility>
+#include <unordered_map>
 #include <fstream>
 #include <iostream>
 #include <functional>
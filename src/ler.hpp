@@ -7,6 +7,7 @@
 
 #include "ler_log.hpp"
 #include "ler_sys.hpp"
+#include "ler_job.hpp"
 #include "ler_dev.hpp"
 #include "ler_spv.hpp"
 #include "ler_env.hpp"
@@ -28,17 +29,32 @@ namespace ler
     struct ImguiImpl
     {
         static vk::UniqueDescriptorPool createPool(LerDevicePtr& device);
-        static void init(LerDevicePtr& device, vk::DescriptorPool pool, RenderPass& renderPass, GLFWwindow* window);
+        static void init(LerDevicePtr& device, vk::DescriptorPool pool, RenderPass& renderPass, GLFWwindow* window, uint32_t imageCount);
         static void begin();
         static void end(vk::CommandBuffer cmd);
         static void clean();
     };
 
+    struct LerSettings
+    {
+        uint32_t framesInFlight = 2;
+        double pipelineCacheInterval = 60.0;
+        ResidencySettings residency;
+    };
+
+    struct FrameContext
+    {
+        vk::UniqueCommandPool commandPool;
+        vk::CommandBuffer commandBuffer;
+        vk::UniqueFence fence;
+        vk::UniqueSemaphore acquireSemaphore;
+    };
+
     class LerApp
     {
     public:
 
-        LerApp();
+        explicit LerApp(const LerSettings& settings = LerSettings());
         ~LerApp();
         void run();
         [[nodiscard]] LerDevicePtr getDevice() const { return m_engine; }
@@ -60,11 +76,16 @@ namespace ler
         static vk::SurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<vk::SurfaceFormatKHR>& availableFormats);
         static vk::Extent2D chooseSwapExtent(const vk::SurfaceCapabilitiesKHR& capabilities, uint32_t width, uint32_t height);
         SwapChain createSwapChain(vk::SurfaceKHR surface, uint32_t width, uint32_t height, bool vSync = true);
+        void createFrames(uint32_t count);
+        void loadPipelineCache();
+        void savePipelineCache();
+        [[nodiscard]] bool isPipelineCacheCompatible(const std::vector<char>& data) const;
 
         static void glfw_key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
         static void glfw_mouse_callback(GLFWwindow* window, int button, int action, int mods);
         static void glfw_scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 
+        LerSettings m_settings;
         GLFWwindow* m_window = nullptr;
         vk::UniqueInstance m_instance;
         uint32_t m_graphicsQueueFamily = UINT32_MAX;
@@ -73,10 +94,16 @@ namespace ler
         vk::UniqueSurfaceKHR m_surface;
         vk::PhysicalDevice m_physicalDevice;
         vk::UniquePipelineCache m_pipelineCache;
+        // Content last loaded or saved, an unchanged cache is not rewritten
+        uint64_t m_pipelineCacheSize = 0;
+        uint64_t m_pipelineCacheHash = 0;
         LerDevicePtr m_engine;
         SwapChain m_swapChain;
         RenderPass m_renderPass;
         vk::UniqueDescriptorPool m_imguiPool;
+        std::vector<FrameContext> m_frames;
+        // One per swapchain image: presentation may still wait on it after the frame fence signaled
+        std::vector<vk::UniqueSemaphore> m_renderSemaphores;
 
         std::vector<ControllerPtr> m_controller;
         std::list<std::function<void()>> m_printer;
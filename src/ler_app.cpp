@@ -7,10 +7,11 @@
 
 static const uint32_t WIDTH = 1280;
 static const uint32_t HEIGHT = 720;
+static const fs::path PIPELINE_CACHE = ler::CACHED_DIR / "pipeline.cache";
 
 namespace ler
 {
-    LerApp::LerApp()
+    LerApp::LerApp(const LerSettings& settings) : m_settings(settings)
     {
         if (!glfwInit())
             throw std::runtime_error("failed to init glfw");
@@ -162,7 +163,7 @@ namespace ler
             throw std::runtime_error("failed to create window surface!");
 
         m_surface = vk::UniqueSurfaceKHR(vk::SurfaceKHR(glfwSurface), { m_instance.get() });
-        m_pipelineCache = m_device->createPipelineCacheUnique({});
+        loadPipelineCache();
 
         // Create Memory Allocator
         VmaAllocatorCreateInfo allocatorCreateInfo = {};
@@ -188,26 +189,104 @@ namespace ler
 
         // Create Engine Instance
         m_engine = std::make_shared<LerDevice>(context);
+        m_engine->setResidencySettings(m_settings.residency);
 
         m_swapChain = createSwapChain(m_surface.get(), WIDTH, HEIGHT);
         m_renderPass = m_engine->createDefaultRenderPass(m_swapChain.format);
+        createFrames(std::max(1u, m_settings.framesInFlight));
 
         // PREPARE ImGui
         m_imguiPool = ImguiImpl::createPool(m_engine);
-        ImguiImpl::init(m_engine, m_imguiPool.get(), m_renderPass, m_window);
-
-        // Mount default directories
-        FileSystemService::Get().mount(StdFileSystem::Create(ASSETS_DIR));
-        FileSystemService::Get().mount(StdFileSystem::Create(CACHED_DIR));
+        ImguiImpl::init(m_engine, m_imguiPool.get(), m_renderPass, m_window, m_frames.size());
     }
 
     LerApp::~LerApp()
     {
         m_device->waitIdle();
+        savePipelineCache();
         glfwDestroyWindow(m_window);
         glfwTerminate();
     }
 
+    bool LerApp::isPipelineCacheCompatible(const std::vector<char>& data) const
+    {
+        VkPipelineCacheHeaderVersionOne header = {};
+        if(data.size() < sizeof(header))
+            return false;
+
+        std::memcpy(&header, data.data(), sizeof(header));
+        auto props = m_physicalDevice.getProperties();
+        return header.headerSize >= sizeof(header) && header.headerSize <= data.size() &&
+            header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+            header.vendorID == props.vendorID &&
+            header.deviceID == props.deviceID &&
+            std::memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+    }
+
+    void LerApp::loadPipelineCache()
+    {
+        std::vector<char> data;
+        std::ifstream file(PIPELINE_CACHE, std::ios::in | std::ios::binary);
+        if(file)
+            data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+        // A cache from another driver or GPU is dropped rather than handed to the driver
+        if(!data.empty() && !isPipelineCacheCompatible(data))
+        {
+            log::warn("Pipeline cache ignored: incompatible header");
+            data.clear();
+        }
+
+        log::info("Pipeline cache: {} bytes loaded", data.size());
+        m_pipelineCacheSize = data.size();
+        m_pipelineCacheHash = hashBytes(data.data(), data.size());
+        vk::PipelineCacheCreateInfo cacheInfo;
+        cacheInfo.setInitialDataSize(data.size());
+        cacheInfo.setPInitialData(data.data());
+        m_pipelineCache = m_device->createPipelineCacheUnique(cacheInfo);
+    }
+
+    void LerApp::savePipelineCache()
+    {
+        auto data = m_device->getPipelineCacheData(m_pipelineCache.get());
+        if(data.empty())
+            return;
+
+        // Most periodic saves find nothing new, skip the disk write
+        const uint64_t hash = hashBytes(data.data(), data.size());
+        if(data.size() == m_pipelineCacheSize && hash == m_pipelineCacheHash)
+            return;
+
+        // Write aside then rename, a crash never leaves a truncated cache behind
+        std::error_code ec;
+        fs::create_directories(CACHED_DIR, ec);
+        fs::path tmp = PIPELINE_CACHE;
+        tmp.concat(".tmp");
+        {
+            // Closed before the rename, buffered bytes would otherwise land after it
+            std::ofstream file(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+            file.flush();
+            file.close();
+            if(!file)
+            {
+                log::warn("Failed to write pipeline cache {}", tmp.string());
+                return;
+            }
+        }
+
+        fs::rename(tmp, PIPELINE_CACHE, ec);
+        if(ec)
+        {
+            log::warn("Failed to save pipeline cache: {}", ec.message());
+            return;
+        }
+
+        m_pipelineCacheSize = data.size();
+        m_pipelineCacheHash = hash;
+        log::debug("Pipeline cache: {} bytes saved", data.size());
+    }
+
     vk::PresentModeKHR LerApp::chooseSwapPresentMode(const std::vector<vk::PresentModeKHR>& availablePresentModes, bool vSync)
     {
         for (const auto& availablePresentMode : availablePresentModes)
@@ -297,13 +376,37 @@ namespace ler
         return swapChain;
     }
 
+    void LerApp::createFrames(uint32_t count)
+    {
+        log::info("Frames in flight: {}", count);
+        m_frames.resize(count);
+        for(auto& frame : m_frames)
+        {
+            frame.commandPool = m_device->createCommandPoolUnique({ vk::CommandPoolCreateFlagBits::eTransient, m_graphicsQueueFamily });
+
+            auto allocInfo = vk::CommandBufferAllocateInfo();
+            allocInfo.setLevel(vk::CommandBufferLevel::ePrimary);
+            allocInfo.setCommandPool(frame.commandPool.get());
+            allocInfo.setCommandBufferCount(1);
+            frame.commandBuffer = m_device->allocateCommandBuffers(allocInfo).front();
+
+            // Signaled so the first wait on each slot returns immediately
+            frame.fence = m_device->createFenceUnique({ vk::FenceCreateFlagBits::eSignaled });
+            frame.acquireSemaphore = m_device->createSemaphoreUnique({});
+        }
+
+        const auto images = m_device->getSwapchainImagesKHR(m_swapChain.handle.get());
+        m_renderSemaphores.resize(images.size());
+        for(auto& semaphore : m_renderSemaphores)
+            semaphore = m_device->createSemaphoreUnique({});
+    }
+
     void LerApp::run()
     {
         vk::Result result;
         vk::CommandBuffer cmd;
+        uint32_t frameIndex = 0;
         uint32_t swapChainIndex = 0;
-        auto queue = m_device->getQueue(m_graphicsQueueFamily, 0);
-        auto presentSemaphore = m_device->createSemaphoreUnique({});
         auto frameBuffers = m_engine->createFrameBuffers(m_renderPass, m_swapChain);
 
         // PREPARE RenderPass
@@ -312,17 +415,31 @@ namespace ler
         vk::Rect2D renderArea(vk::Offset2D(), m_swapChain.extent);
 
         double x, y;
+        double lastCacheSave = glfwGetTime();
 
         while(!glfwWindowShouldClose(m_window))
         {
             glfwPollEvents();
+            auto& frame = m_frames[frameIndex];
+
+            // Resume coroutines waiting on the GPU, then continuations bound to the main thread
+            m_engine->resumeWaiters();
+            MainQueue::Get().drain();
+            m_engine->updateResidency();
+
+            // Wait until the GPU is done with this frame slot
+            result = m_device->waitForFences(frame.fence.get(), true, std::numeric_limits<uint64_t>::max());
+            assert(result == vk::Result::eSuccess);
 
             // Acquire next frame
-            result = m_device->acquireNextImageKHR(m_swapChain.handle.get(), std::numeric_limits<uint64_t>::max(), presentSemaphore.get(), vk::Fence(), &swapChainIndex);
+            result = m_device->acquireNextImageKHR(m_swapChain.handle.get(), std::numeric_limits<uint64_t>::max(), frame.acquireSemaphore.get(), vk::Fence(), &swapChainIndex);
             assert(result == vk::Result::eSuccess);
 
             // Render
-            cmd = m_engine->getCommandBuffer();
+            m_device->resetFences(frame.fence.get());
+            m_device->resetCommandPool(frame.commandPool.get());
+            cmd = frame.commandBuffer;
+            cmd.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
 
             // Update Camera
             if(isCursorLock())
@@ -351,20 +468,23 @@ namespace ler
             ImguiImpl::end(cmd);
 
             cmd.endRenderPass();
-            m_engine->submitAndWait(cmd);
+            auto renderSemaphore = m_renderSemaphores[swapChainIndex].get();
+            m_engine->submitFrame(cmd, frame.acquireSemaphore.get(), renderSemaphore, frame.fence.get());
 
             // Present
-            vk::PresentInfoKHR presentInfo;
-            presentInfo.setWaitSemaphoreCount(1);
-            presentInfo.setPWaitSemaphores(&presentSemaphore.get());
-            presentInfo.setSwapchainCount(1);
-            presentInfo.setPSwapchains(&m_swapChain.handle.get());
-            presentInfo.setPImageIndices(&swapChainIndex);
-
-            result = queue.presentKHR(&presentInfo);
+            result = m_engine->present(m_swapChain.handle.get(), swapChainIndex, renderSemaphore);
             assert(result == vk::Result::eSuccess);
+
+            frameIndex = (frameIndex + 1) % m_frames.size();
+
+            if(glfwGetTime() - lastCacheSave > m_settings.pipelineCacheInterval)
+            {
+                savePipelineCache();
+                lastCacheSave = glfwGetTime();
+            }
         }
 
+        m_device->waitIdle();
         ImguiImpl::clean();
     }
 
@@ -455,11 +575,23 @@ namespace ler
                 m_camera.scrollCallback(glm::vec2(wheel));
         }
 
-        int max = static_cast<int>(batch.meshes.size()-1);
-        if(ImGui::SliderInt("MeshId", &m_id, 0, max))
+        // Meshes may have been removed since the last frame, keep the id inside the batch
+        const bool hasMesh = !batch.meshes.empty();
+        int max = static_cast<int>(batch.meshes.size()) - 1;
+        const int id = std::clamp(m_id, 0, std::max(max, 0));
+        if(hasMesh && id != m_id)
+            switchMesh(batch, id);
+        if(hasMesh && ImGui::SliderInt("MeshId", &m_id, 0, max))
             switchMesh(batch, m_id);
         ImGui::Text("Max Mesh: %zu", batch.meshes.size());
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+        static constexpr std::array<const char*, 3> lanes = { "Frame", "Interactive", "Background" };
+        for(uint32_t i = 0; i < lanes.size(); ++i)
+        {
+            auto m = JobSystem::Get().metrics(static_cast<JobPriority>(i));
+            ImGui::Text("%s: %u queued, %u running, %llu done", lanes[i], m.queued, m.running, static_cast<unsigned long long>(m.executed));
+        }
+        ImGui::Text("I/O: %zu queued, %zu running", Async::GetPool().get_tasks_queued(), Async::GetPool().get_tasks_running());
         ImGui::End();
         ImGui::PopID();
 
@@ -467,13 +599,17 @@ namespace ler
         m_constant.proj = m_camera.getProjMatrix();
         m_constant.proj[1][1] *= -1;
 
+        batch.touch(device, m_id);
         auto cmd = device->getCommandBuffer();
         m_renderTarget->beginRenderPass(cmd);
-        m_meshRenderer.update(m_constant);
-        m_meshRenderer.render(cmd, batch, m_id);
-        m_boxRenderer.update(m_constant);
-        m_boxRenderer.render(cmd, batch, m_id);
+        if(hasMesh)
+        {
+            m_meshRenderer.update(m_constant);
+            m_meshRenderer.render(cmd, batch, m_id);
+            m_boxRenderer.update(m_constant);
+            m_boxRenderer.render(cmd, batch, m_id);
+        }
         cmd.endRenderPass();
-        device->submitAndWait(cmd);
+        device->submit(cmd);
     }
 }
\ No newline at end of file
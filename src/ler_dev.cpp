@@ -6,9 +6,6 @@
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
-#define SPIRV_REFLECT_HAS_VULKAN_H
-#include <spirv_reflect.h>
-
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
@@ -23,14 +20,14 @@ namespace ler
         vk::Format::eD16Unorm
     };
 
-    static const std::array<std::set<std::string>, 5> c_VertexAttrMap =
-    {{
-             {"inPos"},
-             {"inTex", "inUV"},
-             {"inNormal"},
-             {"inTangent"},
-             {"inColor"}
-     }};
+    // Hashes only narrow the search, an entry is a hit when its stored description matches
+    template <typename Map, typename Pred>
+    static auto findCached(Map& map, uint64_t key, Pred&& matches)
+    {
+        auto [begin, end] = map.equal_range(key);
+        auto it = std::find_if(begin, end, [&](const auto& entry){ return matches(entry.second); });
+        return it == end ? map.end() : it;
+    }
 
     LerDevice::LerDevice(const VulkanContext& context) : m_context(context)
     {
@@ -38,14 +35,28 @@ namespace ler
         auto poolUsage = vk::CommandPoolCreateFlagBits::eResetCommandBuffer | vk::CommandPoolCreateFlagBits::eTransient;
         m_commandPool = m_context.device.createCommandPoolUnique({ poolUsage, context.graphicsQueueFamily });
         m_queue = m_context.device.getQueue(context.graphicsQueueFamily, 0);
+
+        // Create Timeline Semaphore
+        vk::SemaphoreTypeCreateInfo timelineInfo(vk::SemaphoreType::eTimeline, 0);
+        vk::SemaphoreCreateInfo semaphoreInfo;
+        semaphoreInfo.setPNext(&timelineInfo);
+        m_timeline = m_context.device.createSemaphoreUnique(semaphoreInfo);
+
+        // Uploads run on the dedicated transfer queue
+        m_transferCommandPool = m_context.device.createCommandPoolUnique({ poolUsage, context.transferQueueFamily });
+        m_transferQueue = m_context.device.getQueue(context.transferQueueFamily, 0);
+        m_transferTimeline = m_context.device.createSemaphoreUnique(semaphoreInfo);
     }
 
     LerDevice::~LerDevice()
     {
+        // Deferred releases still hold allocations
+        m_demoted.clear();
+        m_retired.clear();
         vmaDestroyAllocator(m_context.allocator);
     }
 
-    BufferPtr LerDevice::createBuffer(uint32_t byteSize, vk::BufferUsageFlags usages, bool staging)
+    BufferPtr LerDevice::createBuffer(uint64_t byteSize, vk::BufferUsageFlags usages, bool staging)
     {
         auto buffer = std::make_shared<Buffer>(m_context);
         vk::BufferUsageFlags usageFlags = vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst;
@@ -58,34 +69,388 @@ namespace ler
         buffer->info.setSharingMode(vk::SharingMode::eExclusive);
 
         buffer->allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
-        buffer->allocInfo.flags = staging ? VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT : VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT;
+        buffer->allocInfo.flags = staging ? VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT : VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT;
 
-        vmaCreateBuffer(m_context.allocator, reinterpret_cast<VkBufferCreateInfo*>(&buffer->info), &buffer->allocInfo, reinterpret_cast<VkBuffer*>(&buffer->handle), &buffer->allocation, nullptr);
+        VmaAllocationInfo allocationInfo = {};
+        auto create = [&](){ return vmaCreateBuffer(m_context.allocator, reinterpret_cast<VkBufferCreateInfo*>(&buffer->info), &buffer->allocInfo, reinterpret_cast<VkBuffer*>(&buffer->handle), &buffer->allocation, &allocationInfo); };
+        VkResult result = create();
+        if(result == VK_ERROR_OUT_OF_DEVICE_MEMORY && !staging)
+        {
+            // Drop unreferenced cache entries, then settle for host memory rather than aborting
+            releaseMemory(byteSize);
+            result = create();
+            if(result == VK_ERROR_OUT_OF_DEVICE_MEMORY)
+            {
+                log::warn("Out of device memory, place buffer of {} bytes in host memory", byteSize);
+                buffer->allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+                result = create();
+            }
+        }
+        if(result != VK_SUCCESS)
+            throw std::runtime_error("Failed to allocate buffer: " + vk::to_string(static_cast<vk::Result>(result)));
+        buffer->mapped = allocationInfo.pMappedData;
 
         return buffer;
     }
 
-    void LerDevice::uploadBuffer(BufferPtr& buffer, const void* src, uint32_t byteSize)
+    void LerDevice::trackResidency(const BufferPtr& buffer)
     {
-        assert(src);
-        if(buffer->isStaging() && buffer->length() >= byteSize)
+        std::lock_guard lock(m_mutexResidency);
+        buffer->lastUse.store(m_frame, std::memory_order_relaxed);
+        m_resident.emplace_back(buffer);
+    }
+
+    void LerDevice::addEvictor(std::function<uint64_t(uint64_t)> evictor)
+    {
+        std::lock_guard lock(m_mutexResidency);
+        m_evictors.push_back(std::move(evictor));
+    }
+
+    bool LerDevice::isDeviceLocal(VmaAllocation allocation, uint32_t heap) const
+    {
+        // Host visible device memory (UMA, resizable BAR) gains nothing from a demotion
+        const VkPhysicalDeviceMemoryProperties* properties;
+        vmaGetMemoryProperties(m_context.allocator, &properties);
+        VmaAllocationInfo info;
+        vmaGetAllocationInfo(m_context.allocator, allocation, &info);
+        const auto& type = properties->memoryTypes[info.memoryType];
+        if(heap != UINT32_MAX && type.heapIndex != heap)
+            return false;
+        return (type.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) && !(type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    }
+
+    void LerDevice::retire(TexturePtr texture)
+    {
+        // Tagged by the next updateResidency, the frame being recorded may still bind it
+        std::lock_guard lock(m_mutexRetired);
+        m_retired.emplace_back(0, std::move(texture));
+    }
+
+    void LerDevice::updateResidency()
+    {
+        ++m_frame;
         {
-            void* dst = nullptr;
-            vmaMapMemory(m_context.allocator, static_cast<VmaAllocation>(buffer->allocation), &dst);
-            std::memcpy(dst, src, byteSize);
-            vmaUnmapMemory(m_context.allocator, static_cast<VmaAllocation>(buffer->allocation));
+            std::lock_guard lock(m_mutexResidency);
+            while(!m_demoted.empty() && isComplete(m_demoted.front().first))
+                m_demoted.pop_front();
+        }
+
+        // Every frame that could use a retired texture has been submitted by now
+        uint64_t submitted;
+        {
+            std::lock_guard lock(m_mutexQueue);
+            submitted = m_timelineValue;
+        }
+        {
+            std::lock_guard lock(m_mutexRetired);
+            while(!m_retired.empty() && m_retired.front().first != 0 && isComplete(m_retired.front().first))
+                m_retired.pop_front();
+            for(auto& retired : m_retired)
+            {
+                if(retired.first == 0)
+                    retired.first = std::max<uint64_t>(submitted, 1);
+            }
+        }
+
+        const VkPhysicalDeviceMemoryProperties* properties;
+        vmaGetMemoryProperties(m_context.allocator, &properties);
+        std::array<VmaBudget, VK_MAX_MEMORY_HEAPS> budgets = {};
+        vmaGetHeapBudgets(m_context.allocator, budgets.data());
+
+        for(uint32_t heap = 0; heap < properties->memoryHeapCount; ++heap)
+        {
+            if(!(properties->memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT))
+                continue;
+
+            const auto& budget = budgets[heap];
+            const auto high = static_cast<uint64_t>(static_cast<double>(budget.budget) * m_residency.highWatermark);
+            if(budget.usage <= high)
+                continue;
+
+            // Go down to the low watermark so the next frames do not hover around the limit
+            const auto low = static_cast<uint64_t>(static_cast<double>(budget.budget) * m_residency.lowWatermark);
+            const uint64_t target = budget.usage - low;
+            uint64_t freed = releaseMemory(target);
+            if(freed < target)
+                freed += demoteCold(target - freed, heap);
+            log::warn("Heap {} over budget ({} / {} MiB), released {} MiB", heap, budget.usage >> 20, budget.budget >> 20, freed >> 20);
         }
     }
 
-    void LerDevice::copyBuffer(BufferPtr& src, BufferPtr& dst, uint64_t byteSize, uint64_t dstOffset)
+    uint64_t LerDevice::releaseMemory(uint64_t byteSize)
     {
-        vk::CommandBuffer cmd = getCommandBuffer();
-        vk::BufferCopy copyRegion(0, dstOffset, byteSize);
-        cmd.copyBuffer(src->handle, dst->handle, copyRegion);
-        submitAndWait(cmd);
+        std::lock_guard lock(m_mutexResidency);
+
+        // Caches drop their unreferenced entries, safe from any point of the frame
+        uint64_t freed = 0;
+        for(auto& evictor : m_evictors)
+        {
+            if(freed >= byteSize)
+                break;
+            freed += evictor(byteSize - freed);
+        }
+        return freed;
+    }
+
+    uint64_t LerDevice::demoteCold(uint64_t byteSize, uint32_t heap)
+    {
+        // Only from updateResidency: no frame is being recorded with the handles swapped below
+        std::lock_guard lock(m_mutexResidency);
+        uint64_t freed = 0;
+        std::erase_if(m_resident, [](const std::weak_ptr<Buffer>& w){ return w.expired(); });
+        // Snapshot the frames, draws keep touching buffers while we sort
+        std::vector<std::pair<uint64_t, BufferPtr>> candidates;
+        for(auto& weak : m_resident)
+        {
+            auto buffer = weak.lock();
+            if(!buffer)
+                continue;
+            const uint64_t lastUse = buffer->lastUse.load(std::memory_order_relaxed);
+            if(m_frame - lastUse >= m_residency.coldFrames && isDeviceLocal(buffer->allocation, heap))
+                candidates.emplace_back(lastUse, buffer);
+        }
+        std::ranges::sort(candidates, {}, &std::pair<uint64_t, BufferPtr>::first);
+
+        for(auto& [lastUse, buffer] : candidates)
+        {
+            if(freed >= byteSize)
+                break;
+            if(demoteBuffer(buffer))
+                freed += buffer->length();
+        }
+        return freed;
     }
 
-    void LerDevice::copyBufferToTexture(vk::CommandBuffer& cmd, const BufferPtr& buffer, const TexturePtr& texture)
+    bool LerDevice::demoteBuffer(const BufferPtr& buffer)
+    {
+        // Caller must hold m_mutexResidency
+        // Same buffer object with new memory, users binding it per draw pick up the new handle
+        // The device address changes too, tracked buffers must not hand theirs out
+        auto old = std::make_shared<Buffer>(m_context);
+        old->info = buffer->info;
+        old->allocInfo = buffer->allocInfo;
+        old->allocInfo.usage = VMA_MEMORY_USAGE_AUTO_PREFER_HOST;
+        old->allocInfo.flags = 0;
+        VkResult result = vmaCreateBuffer(m_context.allocator, reinterpret_cast<VkBufferCreateInfo*>(&old->info), &old->allocInfo, reinterpret_cast<VkBuffer*>(&old->handle), &old->allocation, nullptr);
+        if(result != VK_SUCCESS)
+            return false;
+
+        // Pending uploads on the transfer queue may still write the buffer
+        waitTransfer(flushUploads());
+
+        std::swap(buffer->handle, old->handle);
+        std::swap(buffer->allocation, old->allocation);
+        std::swap(buffer->allocInfo, old->allocInfo);
+
+        // Earlier submissions on the queue finish before the copy starts
+        auto cmd = getCommandBuffer();
+        vk::MemoryBarrier before(vk::AccessFlagBits::eMemoryWrite, vk::AccessFlagBits::eTransferRead);
+        cmd.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer, vk::DependencyFlags(), before, {}, {});
+        cmd.copyBuffer(old->handle, buffer->handle, vk::BufferCopy(0, 0, buffer->length()));
+        vk::MemoryBarrier after(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+        cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), after, {}, {});
+
+        // The device local memory is released once the copy is done
+        m_demoted.emplace_back(submit(cmd), old);
+        log::info("Demote buffer of {} bytes to host memory", buffer->length());
+        return true;
+    }
+
+    void LerDevice::copyBuffer(const BufferPtr& src, const BufferPtr& dst, uint64_t byteSize, uint64_t dstOffset)
+    {
+        if(byteSize == VK_WHOLE_SIZE)
+            byteSize = src->length();
+
+        // Recorded by the next flushUploads
+        std::lock_guard<std::mutex> lock(m_mutexTransfer);
+        m_pendingCopies.push_back({src, dst, nullptr, vk::BufferCopy(0, dstOffset, byteSize)});
+    }
+
+    StagingRange LerDevice::allocateStaging(uint64_t byteSize)
+    {
+        const uint64_t alignedSize = std::max(c_stagingAlignment, (byteSize + c_stagingAlignment - 1) & ~(c_stagingAlignment - 1));
+
+        std::lock_guard<std::mutex> lock(m_mutexTransfer);
+        reclaimStaging();
+
+        uint64_t offset = 0;
+        if(!m_staging || !fitStaging(alignedSize, offset))
+        {
+            // Grow, the previous buffer stays alive through the copies still referencing it
+            uint64_t capacity = m_staging ? m_staging->length() * 2 : c_stagingSize;
+            while(capacity < alignedSize)
+                capacity *= 2;
+
+            // Blocks of the old buffer may still be written, they are retired once their copies complete
+            log::debug("Staging ring grows to {} bytes", capacity);
+            std::ranges::move(m_stagingBlocks, std::back_inserter(m_stagingRetired));
+            m_staging = createBuffer(capacity, vk::BufferUsageFlags(), true);
+            m_stagingBlocks.clear();
+            offset = 0;
+        }
+
+        m_stagingBlocks.push_back({m_staging, false, offset, alignedSize, 0});
+        return {m_staging, offset, byteSize, static_cast<std::byte*>(m_staging->mapped) + offset};
+    }
+
+    bool LerDevice::fitStaging(uint64_t byteSize, uint64_t& offset) const
+    {
+        const uint64_t capacity = m_staging->length();
+        if(m_stagingBlocks.empty())
+        {
+            offset = 0;
+            return byteSize <= capacity;
+        }
+
+        const uint64_t tail = m_stagingBlocks.front().offset;
+        const uint64_t head = m_stagingBlocks.back().offset + m_stagingBlocks.back().size;
+        if(head > tail)
+        {
+            // Live blocks in [tail, head), try the end then wrap around
+            if(head + byteSize <= capacity)
+                offset = head;
+            else if(byteSize <= tail)
+                offset = 0;
+            else
+                return false;
+            return true;
+        }
+
+        // Wrapped: live blocks in [tail, capacity) and [0, head)
+        offset = head;
+        return head + byteSize <= tail;
+    }
+
+    void LerDevice::reclaimStaging()
+    {
+        // Caller must hold m_mutexTransfer
+        const uint64_t completed = m_context.device.getSemaphoreCounterValue(m_transferTimeline.get());
+        while(!m_stagingBlocks.empty() && m_stagingBlocks.front().value != 0 && m_stagingBlocks.front().value <= completed)
+            m_stagingBlocks.pop_front();
+        std::erase_if(m_stagingRetired, [completed](const StagingBlock& block){ return block.value != 0 && block.value <= completed; });
+        while(!m_copiesInFlight.empty() && m_copiesInFlight.front().first <= completed)
+            m_copiesInFlight.pop_front();
+    }
+
+    void LerDevice::queueStaging(const StagingRange& range)
+    {
+        // Caller must hold m_mutexTransfer
+        // Only blocks with a queued copy are flushed, others may still be written by their owner
+        auto contains = [&range](const StagingBlock& block){
+            return block.buffer == range.buffer && range.offset >= block.offset && range.offset < block.offset + block.size;
+        };
+
+        auto it = std::find_if(m_stagingBlocks.rbegin(), m_stagingBlocks.rend(), contains);
+        StagingBlock* block = it != m_stagingBlocks.rend() ? &*it : nullptr;
+        if(!block)
+        {
+            auto retired = std::ranges::find_if(m_stagingRetired, contains);
+            block = retired != m_stagingRetired.end() ? &*retired : nullptr;
+        }
+        assert(block);
+
+        // A slice queued after the block was submitted keeps it alive until the next submission
+        block->queued = true;
+        block->value = 0;
+    }
+
+    void LerDevice::copyStaging(const StagingRange& range, const BufferPtr& dst, uint64_t dstOffset)
+    {
+        std::lock_guard<std::mutex> lock(m_mutexTransfer);
+        queueStaging(range);
+        m_pendingCopies.push_back({range.buffer, dst, nullptr, vk::BufferCopy(range.offset, dstOffset, range.size)});
+    }
+
+    void LerDevice::copyStaging(const StagingRange& range, const TexturePtr& dst)
+    {
+        std::lock_guard<std::mutex> lock(m_mutexTransfer);
+        queueStaging(range);
+        m_pendingCopies.push_back({range.buffer, nullptr, dst, vk::BufferCopy(range.offset, 0, range.size)});
+    }
+
+    void LerDevice::uploadBuffer(const BufferPtr& dst, const void* src, uint64_t byteSize, uint64_t dstOffset)
+    {
+        assert(src);
+        auto range = allocateStaging(byteSize);
+        std::memcpy(range.data, src, byteSize);
+        copyStaging(range, dst, dstOffset);
+    }
+
+    void LerDevice::uploadTexture(const TexturePtr& dst, const void* src, uint64_t byteSize)
+    {
+        assert(src);
+        auto range = allocateStaging(byteSize);
+        std::memcpy(range.data, src, byteSize);
+        copyStaging(range, dst);
+    }
+
+    uint64_t LerDevice::flushUploads()
+    {
+        std::lock_guard<std::mutex> lock(m_mutexTransfer);
+        if(m_pendingCopies.empty())
+            return m_transferValue;
+
+        // Every pending region goes into a single transfer submission
+        OwnershipTransfer transfer;
+        vk::CommandBuffer cmd = getTransferCommandBuffer();
+        std::vector<vk::BufferCopy> regions;
+        for(size_t i = 0; i < m_pendingCopies.size(); ++i)
+        {
+            const auto& copy = m_pendingCopies[i];
+            if(copy.texture)
+            {
+                copyBufferToTexture(cmd, copy.src, copy.texture, copy.region.srcOffset);
+                releaseTexture(transfer, copy.texture);
+                continue;
+            }
+
+            regions.push_back(copy.region);
+            const bool last = i + 1 == m_pendingCopies.size();
+            if(!last && m_pendingCopies[i+1].src == copy.src && m_pendingCopies[i+1].dst == copy.dst)
+                continue;
+
+            // Consecutive regions between the same buffers share one command and one barrier
+            uint64_t begin = std::numeric_limits<uint64_t>::max();
+            uint64_t end = 0;
+            for(const auto& region : regions)
+            {
+                begin = std::min(begin, region.dstOffset);
+                end = std::max(end, region.dstOffset + region.size);
+            }
+            cmd.copyBuffer(copy.src->handle, copy.dst->handle, regions);
+            releaseBuffer(transfer, copy.dst, begin, end - begin);
+            regions.clear();
+        }
+
+        auto pending = [](const StagingBlock& block){ return block.queued && block.value == 0; };
+        for(const auto& block : m_stagingBlocks)
+        {
+            if(pending(block))
+                vmaFlushAllocation(m_context.allocator, block.buffer->allocation, block.offset, block.size);
+        }
+        for(const auto& block : m_stagingRetired)
+        {
+            if(pending(block))
+                vmaFlushAllocation(m_context.allocator, block.buffer->allocation, block.offset, block.size);
+        }
+
+        const uint64_t value = submitTransfer(cmd, transfer);
+        for(auto& block : m_stagingBlocks)
+        {
+            if(pending(block))
+                block.value = value;
+        }
+        for(auto& block : m_stagingRetired)
+        {
+            if(pending(block))
+                block.value = value;
+        }
+        m_copiesInFlight.emplace_back(value, std::move(m_pendingCopies));
+        m_pendingCopies.clear();
+        return value;
+    }
+
+    void LerDevice::copyBufferToTexture(vk::CommandBuffer& cmd, const BufferPtr& buffer, const TexturePtr& texture, uint64_t bufferOffset)
     {
         // prepare texture to transfer layout!
         std::vector<vk::ImageMemoryBarrier> imageBarriersStart;
@@ -106,27 +471,164 @@ namespace ler
         cmd.pipelineBarrier(beforeStageFlags, afterStageFlags, vk::DependencyFlags(), {}, {}, imageBarriersStart);
 
         // Copy buffer to texture
-        vk::BufferImageCopy copyRegion(0, 0, 0);
+        vk::BufferImageCopy copyRegion(bufferOffset, 0, 0);
         copyRegion.imageExtent = texture->info.extent;
         copyRegion.imageSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
         cmd.copyBufferToImage(buffer->handle, texture->handle, vk::ImageLayout::eTransferDstOptimal, 1, &copyRegion);
 
-        // prepare texture to color layout
-        std::vector<vk::ImageMemoryBarrier> imageBarriersStop;
-        beforeStageFlags = vk::PipelineStageFlagBits::eTransfer;
-        afterStageFlags = vk::PipelineStageFlagBits::eAllCommands; //eFragmentShader
-        imageBarriersStop.emplace_back(
+        // The switch to color layout is done by the ownership transfer (see releaseTexture)
+    }
+
+    void LerDevice::releaseBuffer(OwnershipTransfer& transfer, const BufferPtr& buffer, uint64_t offset, uint64_t byteSize) const
+    {
+        transfer.buffers.emplace_back(
+            vk::AccessFlagBits::eTransferWrite,
+            vk::AccessFlags(),
+            m_context.transferQueueFamily,
+            m_context.graphicsQueueFamily,
+            buffer->handle,
+            offset,
+            byteSize
+        );
+    }
+
+    void LerDevice::releaseTexture(OwnershipTransfer& transfer, const TexturePtr& texture) const
+    {
+        transfer.images.emplace_back(
             vk::AccessFlagBits::eTransferWrite,
-            vk::AccessFlagBits::eShaderRead,
+            vk::AccessFlags(),
             vk::ImageLayout::eTransferDstOptimal,
             vk::ImageLayout::eShaderReadOnlyOptimal,
-            VK_QUEUE_FAMILY_IGNORED,
-            VK_QUEUE_FAMILY_IGNORED,
+            m_context.transferQueueFamily,
+            m_context.graphicsQueueFamily,
             texture->handle,
             vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1)
         );
+    }
+
+    vk::CommandBuffer LerDevice::getTransferCommandBuffer()
+    {
+        // Caller must hold m_mutexTransfer
+        vk::CommandBuffer cmd;
+        uint64_t completed = m_context.device.getSemaphoreCounterValue(m_transferTimeline.get());
+        while(!m_transferBuffersInFlight.empty() && m_transferBuffersInFlight.front().first <= completed)
+        {
+            m_transferBuffersPool.push_back(m_transferBuffersInFlight.front().second);
+            m_transferBuffersInFlight.pop_front();
+        }
 
-        cmd.pipelineBarrier(beforeStageFlags, afterStageFlags, vk::DependencyFlags(), {}, {}, imageBarriersStop);
+        if (m_transferBuffersPool.empty())
+        {
+            auto allocInfo = vk::CommandBufferAllocateInfo();
+            allocInfo.setLevel(vk::CommandBufferLevel::ePrimary);
+            allocInfo.setCommandPool(m_transferCommandPool.get());
+            allocInfo.setCommandBufferCount(1);
+
+            vk::Result res;
+            res = m_context.device.allocateCommandBuffers(&allocInfo, &cmd);
+            assert(res == vk::Result::eSuccess);
+        }
+        else
+        {
+            cmd = m_transferBuffersPool.front();
+            m_transferBuffersPool.pop_front();
+        }
+
+        cmd.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+        return cmd;
+    }
+
+    uint64_t LerDevice::submitTransfer(vk::CommandBuffer& cmd, OwnershipTransfer& transfer)
+    {
+        // Caller must hold m_mutexTransfer
+        // Release half of the queue family ownership transfer
+        vk::PipelineStageFlags beforeStageFlags = vk::PipelineStageFlagBits::eTransfer;
+        vk::PipelineStageFlags afterStageFlags = vk::PipelineStageFlagBits::eBottomOfPipe;
+        cmd.pipelineBarrier(beforeStageFlags, afterStageFlags, vk::DependencyFlags(), {}, transfer.buffers, transfer.images);
+        cmd.end();
+
+        const uint64_t value = ++m_transferValue;
+        vk::TimelineSemaphoreSubmitInfo timelineInfo;
+        timelineInfo.setSignalSemaphoreValues(value);
+
+        vk::SubmitInfo submitInfo;
+        submitInfo.setPNext(&timelineInfo);
+        submitInfo.setCommandBuffers(cmd);
+        submitInfo.setSignalSemaphores(m_transferTimeline.get());
+        m_transferQueue.submit(submitInfo);
+        m_transferBuffersInFlight.emplace_back(value, cmd);
+
+        // Acquire half is recorded by the next graphics submission
+        for(auto& barrier : transfer.buffers)
+        {
+            barrier.setSrcAccessMask(vk::AccessFlags());
+            barrier.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead | vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite);
+        }
+        for(auto& barrier : transfer.images)
+        {
+            barrier.setSrcAccessMask(vk::AccessFlags());
+            barrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+        }
+        transfer.value = value;
+        m_pendingAcquire.push_back(std::move(transfer));
+        return value;
+    }
+
+    void LerDevice::acquireTransfers()
+    {
+        // Only transfers already finished are acquired, so the graphics queue never stalls on them
+        uint64_t transferValue = 0;
+        std::vector<vk::BufferMemoryBarrier> buffers;
+        std::vector<vk::ImageMemoryBarrier> images;
+        {
+            std::lock_guard<std::mutex> lock(m_mutexTransfer);
+            uint64_t completed = m_context.device.getSemaphoreCounterValue(m_transferTimeline.get());
+            while(!m_pendingAcquire.empty() && m_pendingAcquire.front().value <= completed)
+            {
+                auto& transfer = m_pendingAcquire.front();
+                buffers.insert(buffers.end(), transfer.buffers.begin(), transfer.buffers.end());
+                images.insert(images.end(), transfer.images.begin(), transfer.images.end());
+                transferValue = transfer.value;
+                m_pendingAcquire.pop_front();
+            }
+        }
+
+        if(buffers.empty() && images.empty())
+            return;
+
+        vk::CommandBuffer cmd = getCommandBuffer();
+        vk::PipelineStageFlags stageFlags = vk::PipelineStageFlagBits::eAllCommands;
+        cmd.pipelineBarrier(stageFlags, stageFlags, vk::DependencyFlags(), {}, buffers, images);
+        cmd.end();
+
+        std::lock_guard<std::mutex> lock(m_mutexQueue);
+        const uint64_t value = ++m_timelineValue;
+        vk::TimelineSemaphoreSubmitInfo timelineInfo;
+        timelineInfo.setWaitSemaphoreValues(transferValue);
+        timelineInfo.setSignalSemaphoreValues(value);
+
+        vk::SubmitInfo submitInfo;
+        submitInfo.setPNext(&timelineInfo);
+        submitInfo.setWaitSemaphores(m_transferTimeline.get());
+        submitInfo.setWaitDstStageMask(stageFlags);
+        submitInfo.setCommandBuffers(cmd);
+        submitInfo.setSignalSemaphores(m_timeline.get());
+        m_queue.submit(submitInfo);
+        m_commandBuffersInFlight.emplace_back(value, cmd);
+    }
+
+    void LerDevice::waitTransfer(uint64_t value) const
+    {
+        vk::SemaphoreWaitInfo waitInfo;
+        waitInfo.setSemaphores(m_transferTimeline.get());
+        waitInfo.setValues(value);
+        auto res = m_context.device.waitSemaphores(waitInfo, std::numeric_limits<uint64_t>::max());
+        assert(res == vk::Result::eSuccess);
+    }
+
+    bool LerDevice::isTransferComplete(uint64_t value) const
+    {
+        return m_context.device.getSemaphoreCounterValue(m_transferTimeline.get()) >= value;
     }
 
     static vk::ImageUsageFlags pickImageUsage(vk::Format format, bool isRenderTarget)
@@ -211,7 +713,15 @@ namespace ler
         texture->info.setFlags({});
         texture->info.setTiling(vk::ImageTiling::eOptimal);
 
-        vmaCreateImage(m_context.allocator, reinterpret_cast<VkImageCreateInfo*>(&texture->info), &texture->allocInfo, reinterpret_cast<VkImage*>(&texture->handle), &texture->allocation, nullptr);
+        auto create = [&](){ return vmaCreateImage(m_context.allocator, reinterpret_cast<VkImageCreateInfo*>(&texture->info), &texture->allocInfo, reinterpret_cast<VkImage*>(&texture->handle), &texture->allocation, nullptr); };
+        VkResult result = create();
+        if(result == VK_ERROR_OUT_OF_DEVICE_MEMORY)
+        {
+            releaseMemory(static_cast<uint64_t>(extent.width) * extent.height * formatSize(static_cast<VkFormat>(format)));
+            result = create();
+        }
+        if(result != VK_SUCCESS)
+            throw std::runtime_error("Failed to allocate texture: " + vk::to_string(static_cast<vk::Result>(result)));
 
         vk::ImageViewCreateInfo createInfo;
         createInfo.setImage(texture->handle);
@@ -278,20 +788,16 @@ namespace ler
         if(path.extension() == ".ktx" || path.extension() == ".dds")
             throw std::runtime_error("Can't load image with extension " + path.extension().string());
 
-        auto blob = FileSystemService::Get().readFile(path);
-        auto buff = reinterpret_cast<stbi_uc*>(blob.data());
+        const auto blob = FileSystemService::Get().mapFile(path);
+        auto buff = reinterpret_cast<const stbi_uc*>(blob.data());
         unsigned char* image = stbi_load_from_memory(buff, static_cast<int>(blob.size()), &w, &h, &c, STBI_rgb_alpha);
         //deprecated
         //unsigned char* image = stbi_load(path.string().c_str(), &w, &h, &c, STBI_rgb_alpha);
         size_t imageSize = w * h * 4;
 
-        auto staging = createBuffer(imageSize, vk::BufferUsageFlags(), true);
-        uploadBuffer(staging, image, imageSize);
-
         auto texture = createTexture(vk::Format::eR8G8B8A8Unorm, vk::Extent2D(w, h), vk::SampleCountFlagBits::e1);
-        auto cmd = getCommandBuffer();
-        copyBufferToTexture(cmd, staging, texture);
-        submitAndWait(cmd);
+        uploadTexture(texture, image, imageSize);
+        waitTransfer(flushUploads());
 
         stbi_image_free(image);
         return texture;
@@ -618,70 +1124,60 @@ namespace ler
         cmd.setViewport(0, 1, &viewport);
     }
 
-    uint32_t guessVertexInputBinding(const char* name)
+    ShaderPtr LerDevice::createShader(const fs::path& path)
     {
-        for(size_t i = 0; i < c_VertexAttrMap.size(); ++i)
-            if(c_VertexAttrMap[i].contains(name))
-                return i;
-        throw std::runtime_error("Vertex Input Attribute not reserved");
-    }
+        auto& fs = FileSystemService::Get();
+        auto bytecode = fs.readFile(path);
+        uint64_t hash = hashBytes(bytecode.data(), bytecode.size());
+        auto sameCode = [&bytecode](const ShaderPtr& shader){ return std::ranges::equal(shader->bytecode, bytecode); };
+        {
+            std::lock_guard lock(m_mutexCache);
+            auto it = findCached(m_shaders, hash, sameCode);
+            if(it != m_shaders.end())
+                return it->second;
+        }
 
-    ShaderPtr LerDevice::createShader(const fs::path& path) const
-    {
         auto shader = std::make_shared<Shader>();
-        auto bytecode = FileSystemService::Get().readFile(path);
+        shader->hash = hash;
+        shader->path = path;
+        shader->bytecode.assign(bytecode.begin(), bytecode.end());
         vk::ShaderModuleCreateInfo shaderInfo;
         shaderInfo.setCodeSize(bytecode.size());
         shaderInfo.setPCode(reinterpret_cast<const uint32_t*>(bytecode.data()));
         shader->shaderModule = m_context.device.createShaderModuleUnique(shaderInfo);
 
-        uint32_t count = 0;
-        SpvReflectShaderModule module;
-        SpvReflectResult result = spvReflectCreateShaderModule(bytecode.size(), bytecode.data(), &module);
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
-        assert(module.generator == SPV_REFLECT_GENERATOR_KHRONOS_GLSLANG_REFERENCE_FRONT_END);
+        // Prefer the record written by the shader compiler, reflect the SPIR-V otherwise
+        ShaderReflection reflection;
+        fs::path record = path;
+        record.concat(".refl");
+        bool loaded = false;
+        if(fs.exists(record))
+        {
+            auto data = fs.readFile(record);
+            loaded = readReflection(data, hash, reflection);
+        }
+        if(!loaded && !reflectSpirv(bytecode, reflection))
+            throw std::runtime_error("Failed to reflect shader: " + path.string());
 
-        shader->stageFlagBits = static_cast<vk::ShaderStageFlagBits>(module.shader_stage);
+        shader->stageFlagBits = static_cast<vk::ShaderStageFlagBits>(reflection.stage);
         log::debug("Reflect Shader Stage {}", vk::to_string(shader->stageFlagBits));
 
         // Input Variables
-        result = spvReflectEnumerateInputVariables(&module, &count, nullptr);
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
-
-        std::vector<SpvReflectInterfaceVariable*> inputs(count);
-        result = spvReflectEnumerateInputVariables(&module, &count, inputs.data());
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
-
-        std::set<uint32_t> availableBinding;
-        if (module.shader_stage == SPV_REFLECT_SHADER_STAGE_VERTEX_BIT)
+        for(const auto& in : reflection.attributes)
         {
-            for(auto& in : inputs)
-            {
-                if(in->decoration_flags & SPV_REFLECT_DECORATION_BUILT_IN)
-                    continue;
-
-                uint32_t binding = guessVertexInputBinding(in->name);
-                shader->attributeDesc.emplace_back(in->location, binding, static_cast<vk::Format>(in->format), 0);
-                log::debug("location = {}, binding = {}, name = {}", in->location, binding, in->name);
-                if(!availableBinding.contains(binding))
-                {
-                    shader->bindingDesc.emplace_back(binding, 0, vk::VertexInputRate::eVertex);
-                    availableBinding.insert(binding);
-                }
-            }
-
-            std::sort(shader->attributeDesc.begin(), shader->attributeDesc.end(),
-                [](const VkVertexInputAttributeDescription& a, const VkVertexInputAttributeDescription& b) {
-                    return a.location < b.location;
-            });
+            shader->attributeDesc.emplace_back(in.location, in.binding, static_cast<vk::Format>(in.format), 0);
+            log::debug("location = {}, binding = {}", in.location, in.binding);
+            auto it = std::ranges::find(shader->bindingDesc, in.binding, &vk::VertexInputBindingDescription::binding);
+            if(it == shader->bindingDesc.end())
+                shader->bindingDesc.emplace_back(in.binding, 0, vk::VertexInputRate::eVertex);
+        }
 
-            // Compute final offsets of each attribute, and total vertex stride.
-            for (size_t i = 0; i < shader->attributeDesc.size(); ++i)
-            {
-                uint32_t format_size = formatSize(static_cast<VkFormat>(shader->attributeDesc[i].format));
-                shader->attributeDesc[i].offset = shader->bindingDesc[i].stride;
-                shader->bindingDesc[i].stride += format_size;
-            }
+        // Compute final offsets of each attribute, and total vertex stride.
+        for(auto& attribute : shader->attributeDesc)
+        {
+            auto& binding = *std::ranges::find(shader->bindingDesc, attribute.binding, &vk::VertexInputBindingDescription::binding);
+            attribute.offset = binding.stride;
+            binding.stride += formatSize(static_cast<VkFormat>(attribute.format));
         }
 
         shader->pvi = vk::PipelineVertexInputStateCreateInfo();
@@ -689,60 +1185,93 @@ namespace ler
         shader->pvi.setVertexBindingDescriptions(shader->bindingDesc);
 
         // Push Constants
-        result = spvReflectEnumeratePushConstantBlocks(&module, &count, nullptr);
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+        for(const auto& block : reflection.pushConstants)
+            shader->pushConstants.emplace_back(shader->stageFlagBits, block.offset, block.size);
 
-        std::vector<SpvReflectBlockVariable*> constants(count);
-        result = spvReflectEnumeratePushConstantBlocks(&module, &count, constants.data());
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+        // Descriptor Set
+        for(const auto& bind : reflection.bindings)
+        {
+            auto& desc = shader->descriptorMap[bind.set];
+            desc.set_number = bind.set;
+            auto& binding = desc.bindings.emplace_back();
+            binding.binding = bind.binding;
+            binding.descriptorCount = bind.count;
+            binding.descriptorType = static_cast<vk::DescriptorType>(bind.type);
+            binding.stageFlags = shader->stageFlagBits;
+            log::debug("set = {}, binding = {}, count = {:02}, type = {}", bind.set, binding.binding, binding.descriptorCount, vk::to_string(binding.descriptorType));
+        }
 
-        for(auto& block : constants)
-            shader->pushConstants.emplace_back(shader->stageFlagBits, block->offset, block->size);
+        // Another thread may have created the same shader meanwhile
+        std::lock_guard lock(m_mutexCache);
+        auto it = findCached(m_shaders, hash, sameCode);
+        if(it != m_shaders.end())
+            return it->second;
+        return m_shaders.emplace(hash, shader)->second;
+    }
 
-        // Descriptor Set
-        result = spvReflectEnumerateDescriptorSets(&module, &count, nullptr);
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+    vk::DescriptorSetLayout LerDevice::getDescriptorSetLayout(const std::vector<vk::DescriptorSetLayoutBinding>& bindings)
+    {
+        uint64_t key = 0;
+        for(const auto& b : bindings)
+        {
+            hashCombine(key, b.binding);
+            hashCombine(key, b.descriptorType);
+            hashCombine(key, b.descriptorCount);
+            hashCombine(key, static_cast<VkShaderStageFlags>(b.stageFlags));
+        }
 
-        std::vector<SpvReflectDescriptorSet*> sets(count);
-        result = spvReflectEnumerateDescriptorSets(&module, &count, sets.data());
-        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+        std::lock_guard lock(m_mutexCache);
+        auto it = findCached(m_setLayouts, key, [&](const CachedSetLayout& cached){ return cached.bindings == bindings; });
+        if(it != m_setLayouts.end())
+            return it->second.layout.get();
 
-        for(auto& set : sets)
+        auto descriptorLayoutInfo = vk::DescriptorSetLayoutCreateInfo();
+        descriptorLayoutInfo.setBindings(bindings);
+        auto layout = m_context.device.createDescriptorSetLayoutUnique(descriptorLayoutInfo);
+        return m_setLayouts.emplace(key, CachedSetLayout{ bindings, std::move(layout) })->second.layout.get();
+    }
+
+    vk::PipelineLayout LerDevice::getPipelineLayout(const std::vector<vk::DescriptorSetLayout>& setLayouts, const std::vector<vk::PushConstantRange>& pushConstants)
+    {
+        // Set layouts are deduplicated, so their handles identify them
+        uint64_t key = 0;
+        for(const auto& layout : setLayouts)
+            hashCombine(key, static_cast<VkDescriptorSetLayout>(layout));
+        for(const auto& range : pushConstants)
         {
-            DescriptorSetLayoutData desc;
-            desc.set_number = set->set;
-            desc.bindings.resize(set->binding_count);
-            for(size_t i = 0; i < set->binding_count; ++i)
-            {
-                auto& binding = desc.bindings[i];
-                binding.binding = set->bindings[i]->binding;
-                binding.descriptorCount = set->bindings[i]->count;
-                binding.descriptorType = static_cast<vk::DescriptorType>(set->bindings[i]->descriptor_type);
-                binding.stageFlags = shader->stageFlagBits;
-                log::debug("set = {}, binding = {}, count = {:02}, type = {}", set->set, binding.binding, binding.descriptorCount, vk::to_string(binding.descriptorType));
-            }
-            shader->descriptorMap.insert({set->set, desc});
+            hashCombine(key, static_cast<VkShaderStageFlags>(range.stageFlags));
+            hashCombine(key, range.offset);
+            hashCombine(key, range.size);
         }
 
-        spvReflectDestroyShaderModule(&module);
-        return shader;
+        std::lock_guard lock(m_mutexCache);
+        auto it = findCached(m_pipelineLayouts, key, [&](const CachedPipelineLayout& cached){
+            return cached.setLayouts == setLayouts && cached.pushConstants == pushConstants;
+        });
+        if(it != m_pipelineLayouts.end())
+            return it->second.layout.get();
+
+        auto layoutInfo = vk::PipelineLayoutCreateInfo();
+        layoutInfo.setSetLayouts(setLayouts);
+        layoutInfo.setPushConstantRanges(pushConstants);
+        auto layout = m_context.device.createPipelineLayoutUnique(layoutInfo);
+        return m_pipelineLayouts.emplace(key, CachedPipelineLayout{ setLayouts, pushConstants, std::move(layout) })->second.layout.get();
     }
 
-    void BasePipeline::reflectPipelineLayout(vk::Device device, const std::vector<ShaderPtr>& shaders)
+    void BasePipeline::reflectPipelineLayout(LerDevice& device, const std::vector<ShaderPtr>& shaders, uint32_t textureCount)
     {
         // PIPELINE LAYOUT STATE
-        auto layoutInfo = vk::PipelineLayoutCreateInfo();
         std::vector<vk::PushConstantRange> pushConstants;
         for(auto& shader : shaders)
             pushConstants.insert(pushConstants.end(), shader->pushConstants.begin(), shader->pushConstants.end());
-        layoutInfo.setPushConstantRanges(pushConstants);
 
         // SHADER REFLECT
+        // Shaders are shared through the device cache, copy their bindings instead of moving them
         std::set<uint32_t> sets;
         std::vector<vk::DescriptorPoolSize> descriptorPoolSizeInfo;
         std::multimap<uint32_t,DescriptorSetLayoutData> mergedDesc;
         for(auto& shader : shaders)
-            mergedDesc.merge(shader->descriptorMap);
+            mergedDesc.insert(shader->descriptorMap.begin(), shader->descriptorMap.end());
 
         for(auto& e : mergedDesc)
             sets.insert(e.first);
@@ -756,22 +1285,24 @@ namespace ler
             auto& allocator = std::get<0>(it)->second;
 
             auto descriptorPoolInfo = vk::DescriptorPoolCreateInfo();
-            auto descriptorLayoutInfo = vk::DescriptorSetLayoutCreateInfo();
             auto range = mergedDesc.equal_range(set);
             for (auto e = range.first; e != range.second; ++e)
                 allocator.layoutBinding.insert(allocator.layoutBinding.end(), e->second.bindings.begin(), e->second.bindings.end());
-            descriptorLayoutInfo.setBindings(allocator.layoutBinding);
             for(auto& b : allocator.layoutBinding)
+            {
+                // Unsized sampler arrays take the texture count of the pipeline
+                if(b.stageFlags & vk::ShaderStageFlagBits::eFragment && b.descriptorCount == 0 && b.descriptorType == vk::DescriptorType::eCombinedImageSampler)
+                    b.descriptorCount = textureCount;
                 descriptorPoolSizeInfo.emplace_back(b.descriptorType, b.descriptorCount+2);
+            }
             descriptorPoolInfo.setPoolSizes(descriptorPoolSizeInfo);
             descriptorPoolInfo.setMaxSets(4);
-            allocator.pool = device.createDescriptorPoolUnique(descriptorPoolInfo);
-            allocator.layout = device.createDescriptorSetLayoutUnique(descriptorLayoutInfo);
-            setLayouts.push_back(allocator.layout.get());
+            allocator.pool = device.getVulkanContext().device.createDescriptorPoolUnique(descriptorPoolInfo);
+            allocator.layout = device.getDescriptorSetLayout(allocator.layoutBinding);
+            setLayouts.push_back(allocator.layout);
         }
 
-        layoutInfo.setSetLayouts(setLayouts);
-        pipelineLayout = device.createPipelineLayoutUnique(layoutInfo);
+        pipelineLayout = device.getPipelineLayout(setLayouts, pushConstants);
     }
 
     vk::DescriptorSet BasePipeline::createDescriptorSet(vk::Device& device, uint32_t set)
@@ -785,7 +1316,7 @@ namespace ler
         vk::DescriptorSetAllocateInfo descriptorSetAllocInfo;
         descriptorSetAllocInfo.setDescriptorSetCount(1);
         descriptorSetAllocInfo.setDescriptorPool(allocator.pool.get());
-        descriptorSetAllocInfo.setPSetLayouts(&allocator.layout.get());
+        descriptorSetAllocInfo.setPSetLayouts(&allocator.layout);
         res = device.allocateDescriptorSets(&descriptorSetAllocInfo, &descriptorSet);
         assert(res == vk::Result::eSuccess);
         return descriptorSet;
@@ -802,41 +1333,129 @@ namespace ler
         );
     }
 
+    std::vector<uint32_t> LerDevice::describeRenderPass(const RenderPass& renderPass)
+    {
+        // Render pass compatibility: attachment formats, samples and subpass layout
+        std::vector<uint32_t> layout;
+        layout.push_back(static_cast<uint32_t>(renderPass.attachments.size()));
+        for(auto& attachment : renderPass.attachments)
+        {
+            layout.push_back(static_cast<uint32_t>(attachment.format));
+            layout.push_back(static_cast<uint32_t>(attachment.samples));
+        }
+        for(auto& sub : renderPass.subPass)
+        {
+            layout.push_back(static_cast<uint32_t>(sub.size()));
+            layout.insert(layout.end(), sub.begin(), sub.end());
+        }
+        return layout;
+    }
+
+    uint64_t LerDevice::hashRenderPass(const std::vector<uint32_t>& layout)
+    {
+        return hashBytes(layout.data(), layout.size() * sizeof(uint32_t));
+    }
+
+    uint64_t LerDevice::hashPipeline(uint64_t renderPassHash, const std::vector<ShaderPtr>& shaders, const PipelineInfo& info)
+    {
+        uint64_t key = renderPassHash;
+        for(auto& shader : shaders)
+            hashCombine(key, shader->hash);
+
+        hashCombine(key, info.extent.width);
+        hashCombine(key, info.extent.height);
+        hashCombine(key, info.topology);
+        hashCombine(key, info.polygonMode);
+        hashCombine(key, info.sampleCount);
+        hashCombine(key, info.textureCount);
+        hashCombine(key, info.writeDepth);
+        hashCombine(key, info.lineWidth);
+        hashCombine(key, info.subPass);
+        return key;
+    }
+
+    uint64_t LerDevice::hashPipeline(const ShaderPtr& shader)
+    {
+        uint64_t key = 0;
+        hashCombine(key, shader->hash);
+        hashCombine(key, vk::PipelineBindPoint::eCompute);
+        return key;
+    }
+
     PipelinePtr LerDevice::createGraphicsPipeline(const RenderPass& renderPass, const std::vector<ShaderPtr>& shaders, const PipelineInfo& info)
     {
+        auto renderPassLayout = describeRenderPass(renderPass);
+        uint64_t renderPassHash = hashRenderPass(renderPassLayout);
+        uint64_t key = hashPipeline(renderPassHash, shaders, info);
+        auto matches = [&](const PipelinePtr& cached){
+            if(cached->bindPoint != vk::PipelineBindPoint::eGraphics || cached->shaders != shaders)
+                return false;
+            const auto& graphics = static_cast<const GraphicsPipeline&>(*cached);
+            return graphics.info == info && graphics.renderPassLayout == renderPassLayout;
+        };
+        {
+            std::lock_guard lock(m_mutexCache);
+            auto it = findCached(m_pipelines, key, matches);
+            if(it != m_pipelines.end())
+                return it->second;
+        }
+
         auto pipeline = std::make_shared<GraphicsPipeline>();
+        pipeline->key = key;
+        pipeline->shaders = shaders;
+        pipeline->renderPass = renderPass.handle.get();
+        pipeline->renderPassHash = renderPassHash;
+        pipeline->renderPassLayout = renderPassLayout;
+        pipeline->info = info;
+        for(auto& id : renderPass.subPass[info.subPass])
+        {
+            auto& attachment = renderPass.attachments[id];
+            if(guessImageAspectFlags(attachment.format) == vk::ImageAspectFlagBits::eColor)
+                pipeline->colorAttachmentCount++;
+        }
+        buildGraphicsPipeline(*pipeline);
+
+        std::lock_guard lock(m_mutexCache);
+        auto it = findCached(m_pipelines, key, matches);
+        if(it != m_pipelines.end())
+            return it->second;
+        return m_pipelines.emplace(key, pipeline)->second;
+    }
+
+    void LerDevice::buildGraphicsPipeline(GraphicsPipeline& pipeline)
+    {
         std::vector<vk::PipelineShaderStageCreateInfo> pipelineShaderStages;
-        for(auto& shader : shaders)
+        for(auto& shader : pipeline.shaders)
             addShaderStage(pipelineShaderStages, shader);
 
         // TOPOLOGY STATE
-        vk::PipelineInputAssemblyStateCreateInfo pia(vk::PipelineInputAssemblyStateCreateFlags(), info.topology);
+        vk::PipelineInputAssemblyStateCreateInfo pia(vk::PipelineInputAssemblyStateCreateFlags(), pipeline.info.topology);
 
         // VIEWPORT STATE
-        auto viewport = vk::Viewport(0, 0, static_cast<float>(info.extent.width), static_cast<float>(info.extent.height), 0, 1.0f);
-        auto renderArea = vk::Rect2D(vk::Offset2D(), info.extent);
+        auto viewport = vk::Viewport(0, 0, static_cast<float>(pipeline.info.extent.width), static_cast<float>(pipeline.info.extent.height), 0, 1.0f);
+        auto renderArea = vk::Rect2D(vk::Offset2D(), pipeline.info.extent);
 
         vk::PipelineViewportStateCreateInfo pv(vk::PipelineViewportStateCreateFlagBits(), 1, &viewport, 1, &renderArea);
 
         // Multi Sampling STATE
-        vk::PipelineMultisampleStateCreateInfo pm(vk::PipelineMultisampleStateCreateFlags(), info.sampleCount);
+        vk::PipelineMultisampleStateCreateInfo pm(vk::PipelineMultisampleStateCreateFlags(), pipeline.info.sampleCount);
 
         // POLYGON STATE
         vk::PipelineRasterizationStateCreateInfo pr;
         pr.setDepthClampEnable(VK_TRUE);
         pr.setRasterizerDiscardEnable(VK_FALSE);
-        pr.setPolygonMode(info.polygonMode);
+        pr.setPolygonMode(pipeline.info.polygonMode);
         pr.setFrontFace(vk::FrontFace::eCounterClockwise);
         pr.setDepthBiasEnable(VK_FALSE);
         pr.setDepthBiasConstantFactor(0.f);
         pr.setDepthBiasClamp(0.f);
         pr.setDepthBiasSlopeFactor(0.f);
-        pr.setLineWidth(info.lineWidth);
+        pr.setLineWidth(pipeline.info.lineWidth);
 
         // DEPTH & STENCIL STATE
         vk::PipelineDepthStencilStateCreateInfo pds;
         pds.setDepthTestEnable(VK_TRUE);
-        pds.setDepthWriteEnable(info.writeDepth);
+        pds.setDepthWriteEnable(pipeline.info.writeDepth);
         pds.setDepthCompareOp(vk::CompareOp::eLessOrEqual);
         pds.setDepthBoundsTestEnable(VK_FALSE);
         pds.setStencilTestEnable(VK_FALSE);
@@ -861,12 +1480,7 @@ namespace ler
             vk::ColorComponentFlagBits::eB |
             vk::ColorComponentFlagBits::eA);
 
-        for(auto& id : renderPass.subPass[info.subPass])
-        {
-            auto& attachment = renderPass.attachments[id];
-            if(guessImageAspectFlags(attachment.format) == vk::ImageAspectFlagBits::eColor)
-                colorBlendAttachments.push_back(pcb);
-        }
+        colorBlendAttachments.resize(pipeline.colorAttachmentCount, pcb);
 
         vk::PipelineColorBlendStateCreateInfo pbs;
         pbs.setLogicOpEnable(VK_FALSE);
@@ -882,35 +1496,19 @@ namespace ler
 
         vk::PipelineDynamicStateCreateInfo pdy(vk::PipelineDynamicStateCreateFlags(), dynamicStates);
 
-        // PIPELINE LAYOUT STATE
-        auto layoutInfo = vk::PipelineLayoutCreateInfo();
-        std::vector<vk::PushConstantRange> pushConstants;
-        for(auto& shader : shaders)
-            pushConstants.insert(pushConstants.end(), shader->pushConstants.begin(), shader->pushConstants.end());
-        layoutInfo.setPushConstantRanges(pushConstants);
-
         // SHADER REFLECT
         vk::PipelineVertexInputStateCreateInfo pvi;
-        for(auto& shader : shaders)
+        for(auto& shader : pipeline.shaders)
         {
             if(shader->stageFlagBits == vk::ShaderStageFlagBits::eVertex)
                 pvi = shader->pvi;
-            if(shader->stageFlagBits == vk::ShaderStageFlagBits::eFragment)
-            {
-                for(auto& e : shader->descriptorMap)
-                {
-                    for(auto& bind : e.second.bindings)
-                        if(bind.descriptorCount == 0 && bind.descriptorType == vk::DescriptorType::eCombinedImageSampler)
-                            bind.descriptorCount = info.textureCount;
-                }
-            }
         }
 
-        pipeline->reflectPipelineLayout(m_context.device, shaders);
+        pipeline.reflectPipelineLayout(*this, pipeline.shaders, pipeline.info.textureCount);
 
         auto pipelineInfo = vk::GraphicsPipelineCreateInfo();
-        pipelineInfo.setRenderPass(renderPass.handle.get());
-        pipelineInfo.setLayout(pipeline->pipelineLayout.get());
+        pipelineInfo.setRenderPass(pipeline.renderPass);
+        pipelineInfo.setLayout(pipeline.pipelineLayout);
         pipelineInfo.setStages(pipelineShaderStages);
         pipelineInfo.setPVertexInputState(&pvi);
         pipelineInfo.setPInputAssemblyState(&pia);
@@ -920,39 +1518,118 @@ namespace ler
         pipelineInfo.setPDepthStencilState(&pds);
         pipelineInfo.setPColorBlendState(&pbs);
         pipelineInfo.setPDynamicState(&pdy);
-        pipelineInfo.setSubpass(info.subPass);
+        pipelineInfo.setSubpass(pipeline.info.subPass);
 
         auto res = m_context.device.createGraphicsPipelineUnique(m_context.pipelineCache, pipelineInfo);
         assert(res.result == vk::Result::eSuccess);
-        pipeline->handle = std::move(res.value);
-        return pipeline;
+        pipeline.handle = std::move(res.value);
     }
 
     PipelinePtr LerDevice::createComputePipeline(const ShaderPtr& shader)
     {
+        uint64_t key = hashPipeline(shader);
+        auto matches = [&](const PipelinePtr& cached){
+            return cached->bindPoint == vk::PipelineBindPoint::eCompute && cached->shaders.size() == 1 && cached->shaders.front() == shader;
+        };
+        {
+            std::lock_guard lock(m_mutexCache);
+            auto it = findCached(m_pipelines, key, matches);
+            if(it != m_pipelines.end())
+                return it->second;
+        }
+
         auto pipeline = std::make_shared<ComputePipeline>();
-        std::vector<vk::PipelineShaderStageCreateInfo> pipelineShaderStages;
-        addShaderStage(pipelineShaderStages, shader);
+        pipeline->key = key;
+        pipeline->shaders = { shader };
+        pipeline->bindPoint = vk::PipelineBindPoint::eCompute;
+        buildComputePipeline(*pipeline);
 
-        std::vector<ShaderPtr> shaders = { shader };
-        pipeline->reflectPipelineLayout(m_context.device, shaders);
+        std::lock_guard lock(m_mutexCache);
+        auto it = findCached(m_pipelines, key, matches);
+        if(it != m_pipelines.end())
+            return it->second;
+        return m_pipelines.emplace(key, pipeline)->second;
+    }
+
+    void LerDevice::buildComputePipeline(ComputePipeline& pipeline)
+    {
+        std::vector<vk::PipelineShaderStageCreateInfo> pipelineShaderStages;
+        addShaderStage(pipelineShaderStages, pipeline.shaders.front());
+        pipeline.reflectPipelineLayout(*this, pipeline.shaders);
 
         auto pipelineInfo = vk::ComputePipelineCreateInfo();
         pipelineInfo.setStage(pipelineShaderStages.front());
-        pipelineInfo.setLayout(pipeline->pipelineLayout.get());
+        pipelineInfo.setLayout(pipeline.pipelineLayout);
 
         auto res = m_context.device.createComputePipelineUnique(m_context.pipelineCache, pipelineInfo);
-        pipeline->bindPoint = vk::PipelineBindPoint::eCompute;
         assert(res.result == vk::Result::eSuccess);
-        pipeline->handle = std::move(res.value);
-        return pipeline;
+        pipeline.handle = std::move(res.value);
+    }
+
+    void LerDevice::reloadShaders(const std::vector<fs::path>& paths)
+    {
+        if(paths.empty())
+            return;
+
+        // Pipelines are rebuilt in place, so nothing in flight may still reference them
+        waitIdle();
+
+        std::set<fs::path> changed(paths.begin(), paths.end());
+        auto uses = [&](const ShaderPtr& shader){ return changed.contains(shader->path); };
+        std::vector<PipelinePtr> affected;
+        {
+            std::lock_guard lock(m_mutexCache);
+            for(auto& [key, pipeline] : m_pipelines)
+            {
+                if(std::ranges::any_of(pipeline->shaders, uses))
+                    affected.push_back(pipeline);
+            }
+            std::erase_if(m_shaders, [&](const auto& e){ return changed.contains(e.second->path); });
+        }
+
+        for(auto& pipeline : affected)
+        {
+            for(auto& shader : pipeline->shaders)
+            {
+                if(uses(shader))
+                    shader = createShader(shader->path);
+            }
+
+            // Previous descriptor sets belong to the old pools and must be reallocated
+            pipeline->descriptorAllocMap.clear();
+            uint64_t key;
+            if(pipeline->bindPoint == vk::PipelineBindPoint::eCompute)
+            {
+                auto& compute = static_cast<ComputePipeline&>(*pipeline);
+                buildComputePipeline(compute);
+                key = hashPipeline(compute.shaders.front());
+            }
+            else
+            {
+                auto& graphics = static_cast<GraphicsPipeline&>(*pipeline);
+                buildGraphicsPipeline(graphics);
+                key = hashPipeline(graphics.renderPassHash, graphics.shaders, graphics.info);
+            }
+
+            std::lock_guard lock(m_mutexCache);
+            auto it = findCached(m_pipelines, pipeline->key, [&](const PipelinePtr& cached){ return cached == pipeline; });
+            if(it != m_pipelines.end())
+                m_pipelines.erase(it);
+            pipeline->key = key;
+            m_pipelines.emplace(key, pipeline);
+            log::info("Reload pipeline {:016x}", key);
+        }
     }
 
     vk::CommandBuffer LerDevice::getCommandBuffer()
     {
         vk::CommandBuffer cmd;
+        std::unique_lock<std::mutex> lock(m_mutexQueue);
+        recycleCommandBuffers();
         if (m_commandBuffersPool.empty())
         {
+            lock.unlock();
+
             // Allocate command buffer
             auto allocInfo = vk::CommandBufferAllocateInfo();
             allocInfo.setLevel(vk::CommandBufferLevel::ePrimary);
@@ -967,27 +1644,158 @@ namespace ler
         {
             cmd = m_commandBuffersPool.front();
             m_commandBuffersPool.pop_front();
+            lock.unlock();
         }
 
         cmd.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
         return cmd;
     }
 
+    void LerDevice::recycleCommandBuffers()
+    {
+        // Command buffers go back to the pool once the timeline passed their submission
+        const uint64_t completed = getCompletedValue();
+        while(!m_commandBuffersInFlight.empty() && m_commandBuffersInFlight.front().first <= completed)
+        {
+            m_commandBuffersPool.push_back(m_commandBuffersInFlight.front().second);
+            m_commandBuffersInFlight.pop_front();
+        }
+    }
+
+    uint64_t LerDevice::submit(vk::CommandBuffer& cmd)
+    {
+        cmd.end();
+        acquireTransfers();
+        std::lock_guard<std::mutex> lock(m_mutexQueue);
+        const uint64_t value = ++m_timelineValue;
+
+        vk::TimelineSemaphoreSubmitInfo timelineInfo;
+        timelineInfo.setSignalSemaphoreValues(value);
+
+        vk::SubmitInfo submitInfo;
+        submitInfo.setPNext(&timelineInfo);
+        submitInfo.setCommandBuffers(cmd);
+        submitInfo.setSignalSemaphores(m_timeline.get());
+        m_queue.submit(submitInfo);
+
+        m_commandBuffersInFlight.emplace_back(value, cmd);
+        return value;
+    }
+
     void LerDevice::submitAndWait(vk::CommandBuffer& cmd)
+    {
+        wait(submit(cmd));
+    }
+
+    uint64_t LerDevice::submitFrame(vk::CommandBuffer& cmd, vk::Semaphore wait, vk::Semaphore signal, vk::Fence fence)
     {
         cmd.end();
-        vk::UniqueFence fence = m_context.device.createFenceUnique({});
+        acquireTransfers();
+        vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+        std::lock_guard<std::mutex> lock(m_mutexQueue);
+        const uint64_t value = ++m_timelineValue;
+
+        // Binary semaphores ignore their value
+        std::array<vk::Semaphore, 2> signals = { signal, m_timeline.get() };
+        std::array<uint64_t, 2> signalValues = { 0, value };
+        vk::TimelineSemaphoreSubmitInfo timelineInfo;
+        timelineInfo.setSignalSemaphoreValues(signalValues);
 
         vk::SubmitInfo submitInfo;
+        submitInfo.setPNext(&timelineInfo);
+        submitInfo.setWaitSemaphores(wait);
+        submitInfo.setWaitDstStageMask(waitStage);
         submitInfo.setCommandBuffers(cmd);
-        m_mutexQueue.lock();
-        m_queue.submit(submitInfo, fence.get());
-        m_mutexQueue.unlock();
+        submitInfo.setSignalSemaphores(signals);
 
-        auto res = m_context.device.waitForFences(fence.get(), true, std::numeric_limits<uint64_t>::max());
+        // No host wait: the fence is only checked when the frame slot comes back
+        m_queue.submit(submitInfo, fence);
+        return value;
+    }
+
+    void LerDevice::wait(uint64_t value) const
+    {
+        vk::SemaphoreWaitInfo waitInfo;
+        waitInfo.setSemaphores(m_timeline.get());
+        waitInfo.setValues(value);
+        auto res = m_context.device.waitSemaphores(waitInfo, std::numeric_limits<uint64_t>::max());
         assert(res == vk::Result::eSuccess);
+    }
+
+    void LerDevice::waitIdle()
+    {
+        // Last values handed out on both timelines cover every submission so far
+        uint64_t transferValue;
+        uint64_t value;
+        {
+            std::lock_guard<std::mutex> lock(m_mutexTransfer);
+            transferValue = m_transferValue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutexQueue);
+            value = m_timelineValue;
+        }
+        waitTransfer(transferValue);
+        wait(value);
+    }
 
-        m_commandBuffersPool.push_back(cmd);
+    bool LerDevice::isComplete(uint64_t value) const
+    {
+        return getCompletedValue() >= value;
+    }
+
+    uint64_t LerDevice::getCompletedValue() const
+    {
+        return m_context.device.getSemaphoreCounterValue(m_timeline.get());
+    }
+
+    bool TimelineAwaitable::await_ready() const
+    {
+        return transfer ? device->isTransferComplete(value) : device->isComplete(value);
+    }
+
+    void TimelineAwaitable::await_suspend(std::coroutine_handle<> handle) const
+    {
+        device->enqueueWaiter(value, transfer, handle);
+    }
+
+    void LerDevice::enqueueWaiter(uint64_t value, bool transfer, std::coroutine_handle<> handle)
+    {
+        std::lock_guard lock(m_mutexWaiters);
+        m_waiters.push_back({ value, transfer, handle });
+    }
+
+    void LerDevice::resumeWaiters()
+    {
+        std::vector<TimelineWaiter> ready;
+        {
+            std::lock_guard lock(m_mutexWaiters);
+            if(m_waiters.empty())
+                return;
+
+            const uint64_t completed = getCompletedValue();
+            const uint64_t transferCompleted = m_context.device.getSemaphoreCounterValue(m_transferTimeline.get());
+            auto done = [&](const TimelineWaiter& w){ return w.value <= (w.transfer ? transferCompleted : completed); };
+            std::ranges::copy_if(m_waiters, std::back_inserter(ready), done);
+            std::erase_if(m_waiters, done);
+        }
+
+        // Continuations may record and submit work, keep them off the frame loop
+        for(auto& waiter : ready)
+            Async::GetPool().push_task([handle = waiter.handle](){ handle.resume(); });
+    }
+
+    vk::Result LerDevice::present(vk::SwapchainKHR swapChain, uint32_t imageIndex, vk::Semaphore wait)
+    {
+        vk::PresentInfoKHR presentInfo;
+        presentInfo.setWaitSemaphoreCount(1);
+        presentInfo.setPWaitSemaphores(&wait);
+        presentInfo.setSwapchainCount(1);
+        presentInfo.setPSwapchains(&swapChain);
+        presentInfo.setPImageIndices(&imageIndex);
+
+        std::lock_guard<std::mutex> lock(m_mutexQueue);
+        return m_queue.presentKHR(&presentInfo);
     }
 
     std::vector<char> LerDevice::loadBinaryFromFile(const fs::path& path)
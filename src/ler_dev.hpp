@@ -8,6 +8,8 @@
 #define VULKAN_HPP_DISPATCH_LOADER_DYNAMIC 1
 #include <vulkan/vulkan.hpp>
 #include <vk_mem_alloc.h>
+#include <atomic>
+#include <coroutine>
 #include "common.hpp"
 
 namespace ler
@@ -36,10 +38,13 @@ namespace ler
         vk::BufferCreateInfo info;
         VmaAllocation allocation = nullptr;
         VmaAllocationCreateInfo allocInfo = {};
+        void* mapped = nullptr;
+        // Frame of the last draw, touched from any thread
+        std::atomic<uint64_t> lastUse = 0;
 
         ~Buffer() { vmaDestroyBuffer(m_context.allocator, static_cast<VkBuffer>(handle), allocation); }
         explicit Buffer(const VulkanContext& context) : m_context(context) { }
-        [[nodiscard]] uint32_t length() const { return info.size; }
+        [[nodiscard]] uint64_t length() const { return info.size; }
         [[nodiscard]] bool isStaging() const { return allocInfo.flags & VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT; }
 
     private:
@@ -49,6 +54,16 @@ namespace ler
 
     using BufferPtr = std::shared_ptr<Buffer>;
 
+    struct StagingRange
+    {
+        BufferPtr buffer;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        std::byte* data = nullptr;
+
+        [[nodiscard]] StagingRange slice(uint64_t start, uint64_t byteSize) const { return {buffer, offset + start, byteSize, data + start}; }
+    };
+
     struct Texture
     {
         vk::Image handle;
@@ -59,6 +74,14 @@ namespace ler
 
         ~Texture() { if(allocation) vmaDestroyImage(m_context.allocator, static_cast<VkImage>(handle), allocation); }
         explicit Texture(const VulkanContext& context) : m_context(context) { }
+        [[nodiscard]] uint64_t byteSize() const
+        {
+            if(allocation == nullptr)
+                return 0;
+            VmaAllocationInfo info;
+            vmaGetAllocationInfo(m_context.allocator, allocation, &info);
+            return info.size;
+        }
 
     private:
 
@@ -110,6 +133,10 @@ namespace ler
 
     struct Shader
     {
+        uint64_t hash = 0;
+        fs::path path;
+        // Compared on a cache hit, the hash alone may collide
+        std::vector<char> bytecode;
         vk::UniqueShaderModule shaderModule;
         vk::ShaderStageFlagBits stageFlagBits = {};
         vk::PipelineVertexInputStateCreateInfo pvi;
@@ -124,7 +151,7 @@ namespace ler
     struct DescriptorAllocator
     {
         std::vector<vk::DescriptorSetLayoutBinding> layoutBinding;
-        vk::UniqueDescriptorSetLayout layout;
+        vk::DescriptorSetLayout layout;
         vk::UniqueDescriptorPool pool;
     };
 
@@ -138,26 +165,39 @@ namespace ler
         bool writeDepth = true;
         float lineWidth = 1.f;
         uint32_t subPass = 0;
+
+        bool operator==(const PipelineInfo&) const = default;
     };
 
+    class LerDevice;
     class BasePipeline
     {
     public:
 
-        void reflectPipelineLayout(vk::Device device, const std::vector<ShaderPtr>& shaders);
+        void reflectPipelineLayout(LerDevice& device, const std::vector<ShaderPtr>& shaders, uint32_t textureCount = 0);
         vk::DescriptorSet createDescriptorSet(vk::Device& device, uint32_t set);
 
         vk::UniquePipeline handle;
-        vk::UniquePipelineLayout pipelineLayout;
+        vk::PipelineLayout pipelineLayout;
         vk::PipelineBindPoint bindPoint = vk::PipelineBindPoint::eGraphics;
         std::unordered_map<uint32_t,DescriptorAllocator> descriptorAllocMap;
+
+        // Recipe kept to rebuild the pipeline when one of its shaders is reloaded
+        uint64_t key = 0;
+        std::vector<ShaderPtr> shaders;
     };
 
     using PipelinePtr = std::shared_ptr<BasePipeline>;
 
     class GraphicsPipeline : public BasePipeline
     {
+    public:
 
+        vk::RenderPass renderPass;
+        uint64_t renderPassHash = 0;
+        std::vector<uint32_t> renderPassLayout;
+        uint32_t colorAttachmentCount = 0;
+        PipelineInfo info;
     };
 
     class ComputePipeline : public BasePipeline
@@ -165,6 +205,27 @@ namespace ler
 
     };
 
+    // Watermarks are fractions of the budget VMA reports for each device local heap
+    struct ResidencySettings
+    {
+        float highWatermark = 0.9f;
+        float lowWatermark = 0.75f;
+        uint32_t coldFrames = 300;
+    };
+
+    // Resumes the awaiting coroutine on the thread pool once the timeline reached the value
+    // Timelines are checked once per frame, see LerDevice::resumeWaiters
+    struct TimelineAwaitable
+    {
+        LerDevice* device = nullptr;
+        uint64_t value = 0;
+        bool transfer = false;
+
+        [[nodiscard]] bool await_ready() const;
+        void await_suspend(std::coroutine_handle<> handle) const;
+        void await_resume() const noexcept {}
+    };
+
     class LerDevice
     {
     public:
@@ -173,10 +234,19 @@ namespace ler
         explicit LerDevice(const VulkanContext& context);
 
         // Buffer
-        BufferPtr createBuffer(uint32_t byteSize, vk::BufferUsageFlags usages = vk::BufferUsageFlagBits(), bool staging = false);
-        void uploadBuffer(BufferPtr& staging, const void* src, uint32_t byteSize);
-        void copyBuffer(BufferPtr& src, BufferPtr& dst, uint64_t byteSize = VK_WHOLE_SIZE, uint64_t dstOffset = 0);
-        static void copyBufferToTexture(vk::CommandBuffer& cmd, const BufferPtr& buffer, const TexturePtr& texture);
+        BufferPtr createBuffer(uint64_t byteSize, vk::BufferUsageFlags usages = vk::BufferUsageFlagBits(), bool staging = false);
+        void copyBuffer(const BufferPtr& src, const BufferPtr& dst, uint64_t byteSize = VK_WHOLE_SIZE, uint64_t dstOffset = 0);
+        static void copyBufferToTexture(vk::CommandBuffer& cmd, const BufferPtr& buffer, const TexturePtr& texture, uint64_t bufferOffset = 0);
+
+        // Staging
+        StagingRange allocateStaging(uint64_t byteSize);
+        void copyStaging(const StagingRange& range, const BufferPtr& dst, uint64_t dstOffset = 0);
+        void copyStaging(const StagingRange& range, const TexturePtr& dst);
+        void uploadBuffer(const BufferPtr& dst, const void* src, uint64_t byteSize, uint64_t dstOffset = 0);
+        void uploadTexture(const TexturePtr& dst, const void* src, uint64_t byteSize);
+        uint64_t flushUploads();
+        void waitTransfer(uint64_t value) const;
+        [[nodiscard]] bool isTransferComplete(uint64_t value) const;
 
         // Texture
         TexturePtr createTexture(vk::Format format, const vk::Extent2D& extent, vk::SampleCountFlagBits sampleCount, bool isRenderTarget = false);
@@ -196,28 +266,157 @@ namespace ler
         RenderTargetPtr createRenderTarget(const vk::Extent2D& extent);
 
         // Pipeline
-        ShaderPtr createShader(const fs::path& path) const;
+        ShaderPtr createShader(const fs::path& path);
         PipelinePtr createGraphicsPipeline(const RenderPass& renderPass, const std::vector<ShaderPtr>& shaders, const PipelineInfo& info);
         PipelinePtr createComputePipeline(const ShaderPtr& shader);
+        void reloadShaders(const std::vector<fs::path>& paths);
+        vk::DescriptorSetLayout getDescriptorSetLayout(const std::vector<vk::DescriptorSetLayoutBinding>& bindings);
+        vk::PipelineLayout getPipelineLayout(const std::vector<vk::DescriptorSetLayout>& setLayouts, const std::vector<vk::PushConstantRange>& pushConstants);
 
         // Execution
         vk::CommandBuffer getCommandBuffer();
+        uint64_t submit(vk::CommandBuffer& cmd);
         void submitAndWait(vk::CommandBuffer& cmd);
+        uint64_t submitFrame(vk::CommandBuffer& cmd, vk::Semaphore wait, vk::Semaphore signal, vk::Fence fence);
+        void wait(uint64_t value) const;
+        void waitIdle();
+        [[nodiscard]] bool isComplete(uint64_t value) const;
+        [[nodiscard]] uint64_t getCompletedValue() const;
+        vk::Result present(vk::SwapchainKHR swapChain, uint32_t imageIndex, vk::Semaphore wait);
+
+        // Residency
+        void setResidencySettings(const ResidencySettings& settings) { m_residency = settings; }
+        void trackResidency(const BufferPtr& buffer);
+        void touch(const BufferPtr& buffer) const { buffer->lastUse.store(m_frame, std::memory_order_relaxed); }
+        void addEvictor(std::function<uint64_t(uint64_t)> evictor);
+        void updateResidency();
+        uint64_t releaseMemory(uint64_t byteSize);
+        void retire(TexturePtr texture);
+
+        // Coroutines
+        TimelineAwaitable completion(uint64_t value) { return { this, value, false }; }
+        TimelineAwaitable transferCompletion(uint64_t value) { return { this, value, true }; }
+        void enqueueWaiter(uint64_t value, bool transfer, std::coroutine_handle<> handle);
+        void resumeWaiters();
 
         [[nodiscard]] const VulkanContext& getVulkanContext() const { return m_context; }
 
     private:
 
+        struct StagingBlock
+        {
+            BufferPtr buffer;
+            bool queued = false;
+            uint64_t offset = 0;
+            uint64_t size = 0;
+            uint64_t value = 0;
+        };
+
+        struct PendingCopy
+        {
+            BufferPtr src;
+            BufferPtr dst;
+            TexturePtr texture;
+            vk::BufferCopy region;
+        };
+
+        struct TimelineWaiter
+        {
+            uint64_t value = 0;
+            bool transfer = false;
+            std::coroutine_handle<> handle;
+        };
+
+        struct OwnershipTransfer
+        {
+            uint64_t value = 0;
+            std::vector<vk::BufferMemoryBarrier> buffers;
+            std::vector<vk::ImageMemoryBarrier> images;
+        };
+
+        vk::CommandBuffer getTransferCommandBuffer();
+        uint64_t submitTransfer(vk::CommandBuffer& cmd, OwnershipTransfer& transfer);
+        void releaseBuffer(OwnershipTransfer& transfer, const BufferPtr& buffer, uint64_t offset, uint64_t byteSize) const;
+        void releaseTexture(OwnershipTransfer& transfer, const TexturePtr& texture) const;
+        void acquireTransfers();
+        void reclaimStaging();
+        bool fitStaging(uint64_t byteSize, uint64_t& offset) const;
+        void queueStaging(const StagingRange& range);
+
+        bool isDeviceLocal(VmaAllocation allocation, uint32_t heap) const;
+        uint64_t demoteCold(uint64_t byteSize, uint32_t heap);
+        bool demoteBuffer(const BufferPtr& buffer);
+
         void populateTexture(const TexturePtr& texture, vk::Format format, const vk::Extent2D& extent, vk::SampleCountFlagBits sampleCount, bool isRenderTarget = false);
         static uint32_t formatSize(VkFormat format);
         vk::Format chooseDepthFormat();
         static std::vector<char> loadBinaryFromFile(const fs::path& path);
+        static std::vector<uint32_t> describeRenderPass(const RenderPass& renderPass);
+        static uint64_t hashRenderPass(const std::vector<uint32_t>& layout);
+        static uint64_t hashPipeline(uint64_t renderPassHash, const std::vector<ShaderPtr>& shaders, const PipelineInfo& info);
+        static uint64_t hashPipeline(const ShaderPtr& shader);
+        void buildGraphicsPipeline(GraphicsPipeline& pipeline);
+        void buildComputePipeline(ComputePipeline& pipeline);
+        void recycleCommandBuffers();
 
         VulkanContext m_context;
         std::mutex m_mutexQueue;
         vk::Queue m_queue;
         vk::UniqueCommandPool m_commandPool;
         std::list<vk::CommandBuffer> m_commandBuffersPool;
+        std::list<std::pair<uint64_t, vk::CommandBuffer>> m_commandBuffersInFlight;
+        vk::UniqueSemaphore m_timeline;
+        uint64_t m_timelineValue = 0;
+
+        std::mutex m_mutexTransfer;
+        vk::Queue m_transferQueue;
+        vk::UniqueCommandPool m_transferCommandPool;
+        std::list<vk::CommandBuffer> m_transferBuffersPool;
+        std::list<std::pair<uint64_t, vk::CommandBuffer>> m_transferBuffersInFlight;
+        std::list<OwnershipTransfer> m_pendingAcquire;
+        vk::UniqueSemaphore m_transferTimeline;
+        uint64_t m_transferValue = 0;
+
+        std::mutex m_mutexResidency;
+        ResidencySettings m_residency;
+        std::atomic<uint64_t> m_frame = 0;
+        std::vector<std::weak_ptr<Buffer>> m_resident;
+        std::vector<std::function<uint64_t(uint64_t)>> m_evictors;
+        std::list<std::pair<uint64_t, BufferPtr>> m_demoted;
+
+        std::mutex m_mutexRetired;
+        std::list<std::pair<uint64_t, TexturePtr>> m_retired;
+
+        std::mutex m_mutexWaiters;
+        std::vector<TimelineWaiter> m_waiters;
+
+        struct CachedSetLayout
+        {
+            std::vector<vk::DescriptorSetLayoutBinding> bindings;
+            vk::UniqueDescriptorSetLayout layout;
+        };
+
+        struct CachedPipelineLayout
+        {
+            std::vector<vk::DescriptorSetLayout> setLayouts;
+            std::vector<vk::PushConstantRange> pushConstants;
+            vk::UniquePipelineLayout layout;
+        };
+
+        // Keyed by hash, every hit is checked against the description stored with the object
+        std::mutex m_mutexCache;
+        std::unordered_multimap<uint64_t, ShaderPtr> m_shaders;
+        std::unordered_multimap<uint64_t, PipelinePtr> m_pipelines;
+        std::unordered_multimap<uint64_t, CachedSetLayout> m_setLayouts;
+        std::unordered_multimap<uint64_t, CachedPipelineLayout> m_pipelineLayouts;
+
+        BufferPtr m_staging;
+        std::deque<StagingBlock> m_stagingBlocks;
+        std::vector<StagingBlock> m_stagingRetired;
+        std::vector<PendingCopy> m_pendingCopies;
+        std::list<std::pair<uint64_t, std::vector<PendingCopy>>> m_copiesInFlight;
+        static constexpr uint64_t c_stagingSize = 8388608;
+        static constexpr uint64_t c_stagingAlignment = 16;
     };
 
     using LerDevicePtr = std::shared_ptr<LerDevice>;
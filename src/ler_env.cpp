@@ -6,27 +6,143 @@
 #include "ler_log.hpp"
 #include "ler_sys.hpp"
 
+#include <numeric>
+
 namespace ler
 {
-    void mergeSceneBuffer(const LerDevicePtr& dev, BatchedMesh& batch, BufferPtr& dest, uint32_t firstMesh, const aiScene* aiScene, const std::function<bool(aiMesh*)>& predicate, const std::function<void*(aiMesh*)>& provider)
+    GeometryPool::~GeometryPool()
     {
-        void* data = nullptr;
-        vmaMapMemory(dev->getVulkanContext().allocator, static_cast<VmaAllocation>(batch.staging->allocation), &data);
-        auto cursor = static_cast<std::byte*>(data);
-        size_t offset = 0;
-        for(size_t i = 0; i < aiScene->mNumMeshes; ++i)
+        for(auto& chunk : m_chunks)
         {
-            auto* mesh = aiScene->mMeshes[i];
-            if(predicate(mesh))
-                std::memcpy(cursor + offset * sizeof(glm::vec3), provider(mesh), mesh->mNumVertices * sizeof(glm::vec3));
-            offset+= mesh->mNumVertices;
+            vmaClearVirtualBlock(chunk.block);
+            vmaDestroyVirtualBlock(chunk.block);
+        }
+    }
+
+    void GeometryPool::init(const LerDevicePtr& device, vk::BufferUsageFlags usage, uint32_t stride, uint32_t chunkCapacity, float threshold)
+    {
+        m_device = device;
+        m_usage = usage;
+        m_stride = stride;
+        m_chunkCapacity = chunkCapacity;
+        m_threshold = threshold;
+    }
+
+    void GeometryPool::addChunk(uint32_t capacity)
+    {
+        // Virtual blocks count elements, so every offset is directly a first index/vertex
+        Chunk chunk;
+        chunk.capacity = capacity;
+        chunk.buffer = m_device->createBuffer(static_cast<uint64_t>(capacity) * m_stride, m_usage);
+        m_device->trackResidency(chunk.buffer);
+
+        VmaVirtualBlockCreateInfo blockInfo = {};
+        blockInfo.size = capacity;
+        if(vmaCreateVirtualBlock(&blockInfo, &chunk.block) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create geometry pool chunk");
+
+        log::debug("Geometry pool: new chunk of {} elements ({} bytes)", capacity, chunk.buffer->length());
+        m_chunks.push_back(std::move(chunk));
+    }
+
+    GeometryRange GeometryPool::allocate(uint32_t count)
+    {
+        GeometryRange range;
+        range.count = count;
+        if(count == 0)
+            return range;
+
+        purgeRetired();
+        VmaVirtualAllocationCreateInfo allocInfo = {};
+        allocInfo.size = count;
+
+        VkDeviceSize offset = 0;
+        for(uint32_t i = 0; i < m_chunks.size(); ++i)
+        {
+            if(vmaVirtualAllocate(m_chunks[i].block, &allocInfo, &range.allocation, &offset) == VK_SUCCESS)
+            {
+                range.chunk = i;
+                range.first = static_cast<uint32_t>(offset);
+                return range;
+            }
+        }
+
+        // Grow by one chunk, larger when a single mesh does not fit the default size
+        addChunk(std::max(m_chunkCapacity, count));
+        range.chunk = static_cast<uint32_t>(m_chunks.size() - 1);
+        if(vmaVirtualAllocate(m_chunks.back().block, &allocInfo, &range.allocation, &offset) != VK_SUCCESS)
+            throw std::runtime_error("Failed to allocate " + std::to_string(count) + " elements in a new geometry pool chunk");
+        range.first = static_cast<uint32_t>(offset);
+        return range;
+    }
+
+    void GeometryPool::release(GeometryRange& range)
+    {
+        if(range.allocation != VK_NULL_HANDLE)
+            vmaVirtualFree(m_chunks[range.chunk].block, range.allocation);
+        range = GeometryRange();
+    }
+
+    float GeometryPool::fragmentation(uint32_t chunk) const
+    {
+        VmaDetailedStatistics stats = {};
+        vmaCalculateVirtualBlockStatistics(m_chunks[chunk].block, &stats);
+        const VkDeviceSize unused = stats.statistics.blockBytes - stats.statistics.allocationBytes;
+        if(unused == 0 || stats.statistics.allocationCount == 0)
+            return 0.f;
+        return 1.f - static_cast<float>(stats.unusedRangeSizeMax) / static_cast<float>(unused);
+    }
+
+    void GeometryPool::compact(const std::vector<GeometryRange*>& ranges)
+    {
+        purgeRetired();
+        for(uint32_t c = 0; c < m_chunks.size(); ++c)
+        {
+            auto& chunk = m_chunks[c];
+            if(fragmentation(c) < m_threshold)
+                continue;
+
+            // Repack every live range of the chunk into a fresh buffer
+            auto buffer = m_device->createBuffer(static_cast<uint64_t>(chunk.capacity) * m_stride, m_usage);
+            m_device->trackResidency(buffer);
+            buffer->lastUse.store(chunk.buffer->lastUse.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            vmaClearVirtualBlock(chunk.block);
+
+            std::vector<vk::BufferCopy> regions;
+            VmaVirtualAllocationCreateInfo allocInfo = {};
+            for(auto* range : ranges)
+            {
+                if(range->chunk != c || range->allocation == VK_NULL_HANDLE)
+                    continue;
+
+                VkDeviceSize offset = 0;
+                allocInfo.size = range->count;
+                if(vmaVirtualAllocate(chunk.block, &allocInfo, &range->allocation, &offset) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to repack geometry pool chunk " + std::to_string(c));
+                regions.emplace_back(static_cast<uint64_t>(range->first) * m_stride, offset * m_stride, static_cast<uint64_t>(range->count) * m_stride);
+                range->first = static_cast<uint32_t>(offset);
+            }
+
+            log::info("Geometry pool: compact chunk {} ({} ranges)", c, regions.size());
+            if(!regions.empty())
+            {
+                auto cmd = m_device->getCommandBuffer();
+                cmd.copyBuffer(chunk.buffer->handle, buffer->handle, regions);
+
+                vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+                cmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), barrier, {}, {});
+
+                // The old buffer stays alive until the copy, and every frame before it, is done
+                m_retired.emplace_back(m_device->submit(cmd), chunk.buffer);
+            }
+            chunk.buffer = buffer;
         }
-        vmaUnmapMemory(dev->getVulkanContext().allocator, static_cast<VmaAllocation>(batch.staging->allocation));
-        vk::CommandBuffer cmd = dev->getCommandBuffer();
-        size_t dstOffset = batch.meshes[firstMesh].firstVertex * sizeof(glm::vec3);
-        vk::BufferCopy copyRegion(0, dstOffset, batch.vertexCount * sizeof(glm::vec3));
-        cmd.copyBuffer(batch.staging->handle, dest->handle, copyRegion);
-        dev->submitAndWait(cmd);
+    }
+
+    void GeometryPool::purgeRetired()
+    {
+        while(!m_retired.empty() && m_device->isComplete(m_retired.front().first))
+            m_retired.pop_front();
     }
 
     std::array<glm::vec3, 8> createBox(const MeshInfo& mesh)
@@ -73,15 +189,13 @@ namespace ler
 
     void BatchedMesh::allocate(const LerDevicePtr& device)
     {
-        indexBuffer = device->createBuffer(8388608, vk::BufferUsageFlagBits::eIndexBuffer);
-        vertexBuffer = device->createBuffer(8388608, vk::BufferUsageFlagBits::eVertexBuffer);
-        aabbBuffer = device->createBuffer(24*500*sizeof(glm::vec3), vk::BufferUsageFlagBits::eVertexBuffer);
-        staging = device->createBuffer(8388608, vk::BufferUsageFlags(), true);
+        indexPool.init(device, vk::BufferUsageFlagBits::eIndexBuffer, sizeof(uint32_t), 16777216);
+        vertexPool.init(device, vk::BufferUsageFlagBits::eVertexBuffer, sizeof(glm::vec3), 4194304);
+        aabbPool.init(device, vk::BufferUsageFlagBits::eVertexBuffer, sizeof(glm::vec3), 24*4096);
     }
 
-    bool BatchedMesh::appendMeshFromFile(const LerDevicePtr& device, const fs::path& path)
+    const aiScene* importScene(Assimp::Importer& importer, const fs::path& path)
     {
-        Assimp::Importer importer;
         fs::path cleanPath = path;
         log::info("Load scene: {}", cleanPath.make_preferred().string());
         unsigned int postProcess = aiProcessPreset_TargetRealtime_Fast;
@@ -89,147 +203,198 @@ namespace ler
         postProcess |= aiProcess_GenBoundingBoxes;
         // TODO: finish scene import
         //const aiScene* aiScene = importer.ReadFile(path.string(), postProcess);
-        const auto blob = FileSystemService::Get().readFile(path);
-        const aiScene* aiScene = importer.ReadFileFromMemory(blob.data(), blob.size(), postProcess, path.string().c_str());
-        if(aiScene == nullptr || aiScene->mNumMeshes < 0)
+        const auto blob = FileSystemService::Get().mapFile(path);
+        return importer.ReadFileFromMemory(blob.data(), blob.size(), postProcess, path.string().c_str());
+    }
+
+    void describeMesh(MeshInfo& info, const aiMesh* mesh, const fs::path& path)
+    {
+        log::debug("Mesh: {}", mesh->mName.C_Str());
+        info.countIndex = mesh->mNumFaces * 3;
+        info.countVertex = mesh->mNumVertices;
+        info.bMin = glm::make_vec3(&mesh->mAABB.mMin[0]);
+        info.bMax = glm::make_vec3(&mesh->mAABB.mMax[0]);
+        info.name = mesh->mName.C_Str();
+        info.file = path;
+    }
+
+    bool BatchedMesh::appendMeshFromFile(const LerDevicePtr& device, const fs::path& path)
+    {
+        Assimp::Importer importer;
+        const aiScene* aiScene = importScene(importer, path);
+        if(aiScene == nullptr)
             return false;
 
-        // Prepare indirect data
-        MeshInfo ind;
-        uint32_t firstMesh = meshes.size();
-        uint32_t indicesCount = 0;
-        meshes.reserve(firstMesh+aiScene->mNumMeshes);
-        for(size_t i = 0; i < aiScene->mNumMeshes; ++i)
+        // Prepare indirect data, describing a mesh is too cheap to split, the staging fill is (see uploadMeshes)
+        std::vector<size_t> slots(aiScene->mNumMeshes);
+        std::iota(slots.begin(), slots.end(), meshes.size());
+        meshes.resize(meshes.size()+aiScene->mNumMeshes);
+        for(size_t i = 0; i < slots.size(); ++i)
         {
-            auto* mesh = aiScene->mMeshes[i];
-            log::debug("Mesh: {}", mesh->mName.C_Str());
-            ind.countIndex = mesh->mNumFaces * 3;
-            ind.firstIndex = indexCount;
-            ind.countVertex = mesh->mNumVertices;
-            ind.firstVertex = static_cast<int32_t>(vertexCount);
-            ind.bMin = glm::make_vec3(&mesh->mAABB.mMin[0]);
-            ind.bMax = glm::make_vec3(&mesh->mAABB.mMax[0]);
-            ind.name = mesh->mName.C_Str();
-            meshes.push_back(ind);
-
-            indexCount+= ind.countIndex;
-            vertexCount+= ind.countVertex;
-            indicesCount+= ind.countIndex;
+            auto& ind = meshes[slots[i]];
+            describeMesh(ind, aiScene->mMeshes[i], path);
+            ind.index = indexPool.allocate(ind.countIndex);
+            ind.vertex = vertexPool.allocate(ind.countVertex);
+            ind.box = aabbPool.allocate(24);
         }
 
-        // Merge vertex
-        mergeSceneBuffer(device, *this, vertexBuffer, firstMesh, aiScene, [](aiMesh* mesh){ return mesh->HasPositions(); }, [](aiMesh* mesh){ return mesh->mVertices; });
+        uploadMeshes(device, aiScene, slots, JobPriority::Interactive);
+        return true;
+    }
 
-        // Merge index
-        std::vector<uint32_t> indices;
-        indices.reserve(indicesCount);
-        for(size_t i = 0; i < aiScene->mNumMeshes; ++i)
+    bool BatchedMesh::reloadMeshFromFile(const LerDevicePtr& device, const fs::path& path)
+    {
+        // Slots of the file, in mesh order, they are not contiguous once a reload appended some
+        std::vector<size_t> slots;
+        for(size_t i = 0; i < meshes.size(); ++i)
         {
-            auto *mesh = aiScene->mMeshes[i];
-            if (mesh->HasFaces())
-            {
-                for (size_t j = 0; j < mesh->mNumFaces; ++j)
-                {
-                    indices.insert(indices.end(), mesh->mFaces[j].mIndices, mesh->mFaces[j].mIndices + 3);
-                }
-            }
+            if(meshes[i].file == path)
+                slots.push_back(i);
         }
+        if(slots.empty())
+            return false;
 
-        size_t byteSize = indices.size() * sizeof(uint32_t);
-        size_t dstOffset = meshes[firstMesh].firstIndex * sizeof(uint32_t);
-        device->uploadBuffer(staging, indices.data(), byteSize);
-        device->copyBuffer(staging, indexBuffer, byteSize, dstOffset);
+        Assimp::Importer importer;
+        const aiScene* aiScene = importScene(importer, path);
+        if(aiScene == nullptr)
+            return false;
 
-        std::vector<glm::vec3> lines;
-        lines.reserve(24*aiScene->mNumMeshes);
-        for(size_t i = firstMesh; i < meshes.size(); ++i)
+        // Ranges are overwritten in place, no frame in flight may still read them
+        device->waitIdle();
+
+        // Mesh ids stay stable: extra meshes go at the end, surplus slots are left empty for a later reload
+        const size_t newCount = aiScene->mNumMeshes;
+        const size_t oldCount = slots.size();
+        for(size_t i = newCount; i < oldCount; ++i)
+        {
+            auto& mesh = meshes[slots[i]];
+            indexPool.release(mesh.index);
+            vertexPool.release(mesh.vertex);
+            aabbPool.release(mesh.box);
+            mesh = MeshInfo();
+            mesh.file = path;
+        }
+        for(size_t i = oldCount; i < newCount; ++i)
         {
-            const auto& mesh = meshes[i];
-            auto pts = createBox(mesh);
-            addBox(lines, pts);
+            slots.push_back(meshes.size());
+            meshes.emplace_back();
         }
+        slots.resize(newCount);
 
-        byteSize = lines.size()*sizeof(glm::vec3);
-        dstOffset = firstMesh * 24 * sizeof(glm::vec3);
-        device->uploadBuffer(staging, lines.data(), byteSize);
-        device->copyBuffer(staging, aabbBuffer, byteSize, dstOffset);
+        // Existing ranges are reused while the new geometry fits in them
+        for(size_t i = 0; i < newCount; ++i)
+        {
+            auto& ind = meshes[slots[i]];
+            describeMesh(ind, aiScene->mMeshes[i], path);
+            if(ind.countIndex > ind.index.count)
+            {
+                indexPool.release(ind.index);
+                ind.index = indexPool.allocate(ind.countIndex);
+            }
+            if(ind.countVertex > ind.vertex.count)
+            {
+                vertexPool.release(ind.vertex);
+                ind.vertex = vertexPool.allocate(ind.countVertex);
+            }
+            if(ind.box.allocation == VK_NULL_HANDLE)
+                ind.box = aabbPool.allocate(24);
+        }
 
+        // Called from the frame, which stalls until the file is back on the GPU
+        uploadMeshes(device, aiScene, slots, JobPriority::Frame);
+        log::info("Reload scene: {} ({} meshes)", path.string(), newCount);
         return true;
     }
 
-    BatchedMesh loadMeshFromFile(const LerDevicePtr& device, const fs::path& path)
+    void BatchedMesh::uploadMeshes(const LerDevicePtr& device, const aiScene* aiScene, const std::vector<size_t>& slots, JobPriority priority)
     {
-        Assimp::Importer importer;
-        fs::path cleanPath = path;
-        log::info("Load scene: {}", cleanPath.make_preferred().string());
-        unsigned int postProcess = aiProcessPreset_TargetRealtime_Fast;
-        postProcess |= aiProcess_ConvertToLeftHanded;
-        postProcess |= aiProcess_GenBoundingBoxes;
-        const aiScene* aiScene = importer.ReadFile(path.string(), postProcess);
-        if(aiScene == nullptr || aiScene->mNumMeshes < 0)
-            return {};
-
-        BatchedMesh batch;
-        batch.indexBuffer = device->createBuffer(8388608, vk::BufferUsageFlagBits::eIndexBuffer);
-        batch.vertexBuffer = device->createBuffer(8388608, vk::BufferUsageFlagBits::eVertexBuffer);
-        batch.staging = device->createBuffer(8388608, vk::BufferUsageFlags(), true);
+        // Prefix offsets give every mesh its own bytes in staging, meshes then fill in parallel
+        const size_t count = aiScene->mNumMeshes;
+        std::vector<uint64_t> vertexOffsets(count + 1, 0);
+        std::vector<uint64_t> indexOffsets(count + 1, 0);
+        for(size_t i = 0; i < count; ++i)
+        {
+            vertexOffsets[i+1] = vertexOffsets[i] + meshes[slots[i]].countVertex * sizeof(glm::vec3);
+            indexOffsets[i+1] = indexOffsets[i] + meshes[slots[i]].countIndex * sizeof(uint32_t);
+        }
 
-        MeshInfo ind;
+        // Merge the whole file in staging, then copy each mesh into its own ranges
+        constexpr uint64_t boxSize = 24 * sizeof(glm::vec3);
+        auto vertices = device->allocateStaging(vertexOffsets.back());
+        auto indices = device->allocateStaging(indexOffsets.back());
+        auto boxes = device->allocateStaging(count * boxSize);
 
-        // Prepare indirect data
-        batch.meshes.reserve(aiScene->mNumMeshes);
-        for(size_t i = 0; i < aiScene->mNumMeshes; ++i)
-        {
+        JobSystem::Get().parallel_for(count, 16, [&](size_t i){
             auto* mesh = aiScene->mMeshes[i];
-            log::debug("Mesh: {}", mesh->mName.C_Str());
-            ind.countIndex = mesh->mNumFaces * 3;
-            ind.firstIndex = batch.indexCount;
-            ind.countVertex = mesh->mNumVertices;
-            ind.firstVertex = static_cast<int32_t>(batch.vertexCount);
-            ind.bMin = glm::make_vec3(&mesh->mAABB.mMin[0]);
-            ind.bMax = glm::make_vec3(&mesh->mAABB.mMax[0]);
-            ind.name = mesh->mName.C_Str();
-            batch.meshes.push_back(ind);
-
-            batch.indexCount+= ind.countIndex;
-            batch.vertexCount+= ind.countVertex;
-        }
+            const auto& info = meshes[slots[i]];
 
-        // Merge vertex
-        mergeSceneBuffer(device, batch, batch.vertexBuffer, 0, aiScene, [](aiMesh* mesh){ return mesh->HasPositions(); }, [](aiMesh* mesh){ return mesh->mVertices; });
+            if(info.countVertex > 0 && mesh->HasPositions())
+                std::memcpy(vertices.data + vertexOffsets[i], mesh->mVertices, info.countVertex * sizeof(glm::vec3));
 
-        // Merge index
-        std::vector<uint32_t> indices;
-        indices.reserve(batch.indexCount);
-        for(size_t i = 0; i < aiScene->mNumMeshes; ++i)
+            auto* cursor = reinterpret_cast<uint32_t*>(indices.data + indexOffsets[i]);
+            for (size_t j = 0; j < mesh->mNumFaces; ++j)
+                std::memcpy(cursor + j * 3, mesh->mFaces[j].mIndices, 3 * sizeof(uint32_t));
+
+            std::vector<glm::vec3> lines;
+            lines.reserve(24);
+            addBox(lines, createBox(info));
+            std::memcpy(boxes.data + i * boxSize, lines.data(), boxSize);
+        }, priority);
+
+        // Copies are recorded in mesh order, the transfer lock is taken once per region anyway
+        for(size_t i = 0; i < count; ++i)
         {
-            auto *mesh = aiScene->mMeshes[i];
-            if (mesh->HasFaces())
-            {
-                for (size_t j = 0; j < mesh->mNumFaces; j++)
-                {
-                    indices.insert(indices.end(), mesh->mFaces[j].mIndices, mesh->mFaces[j].mIndices + 3);
-                }
-            }
+            const auto& info = meshes[slots[i]];
+            uint64_t byteSize = vertexOffsets[i+1] - vertexOffsets[i];
+            if(byteSize > 0)
+                device->copyStaging(vertices.slice(vertexOffsets[i], byteSize), vertexPool.getBuffer(info.vertex.chunk), info.vertex.first * sizeof(glm::vec3));
+            byteSize = indexOffsets[i+1] - indexOffsets[i];
+            if(byteSize > 0)
+                device->copyStaging(indices.slice(indexOffsets[i], byteSize), indexPool.getBuffer(info.index.chunk), info.index.first * sizeof(uint32_t));
+            device->copyStaging(boxes.slice(i * boxSize, boxSize), aabbPool.getBuffer(info.box.chunk), info.box.first * sizeof(glm::vec3));
         }
 
-        size_t byteSize = indices.size() * sizeof(uint32_t);
-        device->uploadBuffer(batch.staging, indices.data(), byteSize);
-        device->copyBuffer(batch.staging, batch.indexBuffer, byteSize);
+        // Vertex, index and box regions leave in one transfer submission
+        device->waitTransfer(device->flushUploads());
+    }
+
+    void BatchedMesh::touch(const LerDevicePtr& device, uint32_t id) const
+    {
+        // Slots left empty by a reload hold no range
+        if(id >= meshes.size() || meshes[id].box.allocation == VK_NULL_HANDLE)
+            return;
+        const auto& mesh = meshes[id];
+        device->touch(indexPool.getBuffer(mesh.index.chunk));
+        device->touch(vertexPool.getBuffer(mesh.vertex.chunk));
+        device->touch(aabbPool.getBuffer(mesh.box.chunk));
+    }
+
+    void BatchedMesh::removeMesh(uint32_t id)
+    {
+        auto& mesh = meshes[id];
+        indexPool.release(mesh.index);
+        vertexPool.release(mesh.vertex);
+        aabbPool.release(mesh.box);
+        meshes.erase(meshes.begin() + id);
 
-        std::vector<glm::vec3> lines;
-        lines.reserve(5000);
-        for(const auto & mesh : batch.meshes)
+        // Each pool only repacks the chunks whose fragmentation passed its threshold
+        std::vector<GeometryRange*> indexRanges, vertexRanges, boxRanges;
+        for(auto& m : meshes)
         {
-            auto pts = createBox(mesh);
-            addBox(lines, pts);
+            indexRanges.push_back(&m.index);
+            vertexRanges.push_back(&m.vertex);
+            boxRanges.push_back(&m.box);
         }
+        indexPool.compact(indexRanges);
+        vertexPool.compact(vertexRanges);
+        aabbPool.compact(boxRanges);
+    }
 
-        byteSize = 10*24*sizeof(glm::vec3);
-        batch.aabbBuffer = device->createBuffer(byteSize, vk::BufferUsageFlagBits::eVertexBuffer);
-        device->uploadBuffer(batch.staging, lines.data(), byteSize);
-        device->copyBuffer(batch.staging, batch.aabbBuffer, byteSize);
-
+    BatchedMesh loadMeshFromFile(const LerDevicePtr& device, const fs::path& path)
+    {
+        BatchedMesh batch;
+        batch.allocate(device);
+        batch.appendMeshFromFile(device, path);
         return batch;
     }
-}
\ No newline at end of file
+}
@@ -7,6 +7,7 @@
 
 #include "common.hpp"
 #include "ler_dev.hpp"
+#include "ler_job.hpp"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -16,29 +17,85 @@
 
 namespace ler
 {
+    struct GeometryRange
+    {
+        uint32_t chunk = 0;
+        uint32_t first = 0;
+        uint32_t count = 0;
+        VmaVirtualAllocation allocation = VK_NULL_HANDLE;
+    };
+
+    class GeometryPool
+    {
+    public:
+
+        GeometryPool() = default;
+        ~GeometryPool();
+        GeometryPool(GeometryPool&&) = default;
+        GeometryPool& operator=(GeometryPool&&) = default;
+        GeometryPool(const GeometryPool&) = delete;
+        GeometryPool& operator=(const GeometryPool&) = delete;
+
+        void init(const LerDevicePtr& device, vk::BufferUsageFlags usage, uint32_t stride, uint32_t chunkCapacity, float threshold = 0.5f);
+        GeometryRange allocate(uint32_t count);
+        void release(GeometryRange& range);
+        void compact(const std::vector<GeometryRange*>& ranges);
+        [[nodiscard]] const BufferPtr& getBuffer(uint32_t chunk) const { return m_chunks[chunk].buffer; }
+        [[nodiscard]] uint32_t getStride() const { return m_stride; }
+        [[nodiscard]] float fragmentation(uint32_t chunk) const;
+
+    private:
+
+        struct Chunk
+        {
+            BufferPtr buffer;
+            VmaVirtualBlock block = VK_NULL_HANDLE;
+            uint32_t capacity = 0;
+        };
+
+        void addChunk(uint32_t capacity);
+        void purgeRetired();
+
+        LerDevicePtr m_device;
+        vk::BufferUsageFlags m_usage;
+        uint32_t m_stride = 0;
+        uint32_t m_chunkCapacity = 0;
+        float m_threshold = 0.5f;
+        std::vector<Chunk> m_chunks;
+        std::list<std::pair<uint64_t, BufferPtr>> m_retired;
+    };
+
     struct MeshInfo
     {
         uint32_t countIndex = 0;
-        uint32_t firstIndex = 0;
         uint32_t countVertex = 0;
-        int32_t firstVertex = 0;
+        GeometryRange index;
+        GeometryRange vertex;
+        GeometryRange box;
         glm::vec3 bMin = glm::vec3(0.f);
         glm::vec3 bMax = glm::vec3(0.f);
         std::string name;
+        fs::path file;
     };
 
     struct BatchedMesh
     {
-        BufferPtr indexBuffer;
-        BufferPtr vertexBuffer;
-        BufferPtr aabbBuffer;
-        BufferPtr staging;
+        GeometryPool indexPool;
+        GeometryPool vertexPool;
+        GeometryPool aabbPool;
         std::vector<MeshInfo> meshes;
-        uint32_t vertexCount = 0;
-        uint32_t indexCount = 0;
 
         void allocate(const LerDevicePtr& device);
         bool appendMeshFromFile(const LerDevicePtr& device, const fs::path& path);
+        // Main thread only, between frames: waits for the device and rewrites ranges in place
+        // Mesh ids of the file are kept, extra meshes get new ids at the end
+        bool reloadMeshFromFile(const LerDevicePtr& device, const fs::path& path);
+        void removeMesh(uint32_t id);
+        void touch(const LerDevicePtr& device, uint32_t id) const;
+
+    private:
+
+        void uploadMeshes(const LerDevicePtr& device, const aiScene* aiScene, const std::vector<size_t>& slots, JobPriority priority);
     };
 
     struct SceneConstant
@@ -32,7 +32,7 @@ namespace ler
         return ctx.device.createDescriptorPoolUnique(poolInfo);
     }
 
-    void ImguiImpl::init(LerDevicePtr& device, vk::DescriptorPool pool, RenderPass& renderPass, GLFWwindow* window)
+    void ImguiImpl::init(LerDevicePtr& device, vk::DescriptorPool pool, RenderPass& renderPass, GLFWwindow* window, uint32_t imageCount)
     {
         auto ctx = device->getVulkanContext();
 
@@ -53,7 +53,7 @@ namespace ler
         init_info.Queue = ctx.device.getQueue(ctx.graphicsQueueFamily, 0);
         init_info.DescriptorPool = pool;
         init_info.MinImageCount = 2;
-        init_info.ImageCount = 2;
+        init_info.ImageCount = std::max(init_info.MinImageCount, imageCount);
         init_info.Subpass = 2;
         init_info.MSAASamples = VK_SAMPLE_COUNT_8_BIT;
         ImGui_ImplVulkan_Init(&init_info, renderPass.handle.get());
@@ -0,0 +1,173 @@
+//
+// Created by loulfy on 17/10/2026.
+//
+
+#include "ler_job.hpp"
+
+namespace ler
+{
+    // Queue owned by the current thread, the injection queue outside the system
+    static thread_local const JobSystem* t_system = nullptr;
+    static thread_local uint32_t t_queue = 0;
+
+    JobSystem::JobSystem(uint32_t workerCount, uint32_t reservedWorkers)
+    {
+        // Keep at least one worker able to run background jobs
+        m_reserved = std::min(reservedWorkers, workerCount - 1);
+        for(uint32_t i = 0; i <= workerCount; ++i)
+            m_queues.push_back(std::make_unique<Queue>());
+
+        m_threads.reserve(workerCount);
+        for(uint32_t i = 0; i < workerCount; ++i)
+            m_threads.emplace_back(&JobSystem::workerLoop, this, i);
+    }
+
+    JobSystem::~JobSystem()
+    {
+        {
+            std::lock_guard lock(m_sleepMutex);
+            m_running = false;
+        }
+        m_wake.notify_all();
+        for(auto& thread : m_threads)
+            thread.join();
+    }
+
+    JobSystem& JobSystem::Get()
+    {
+        static JobSystem system;
+        return std::ref(system);
+    }
+
+    void JobSystem::run(JobCounter& counter, std::function<void()> job, JobPriority priority)
+    {
+        counter.m_pending.fetch_add(1, std::memory_order_relaxed);
+        auto current = counter.m_priority.load(std::memory_order_relaxed);
+        while(current < static_cast<uint32_t>(priority) && !counter.m_priority.compare_exchange_weak(current, static_cast<uint32_t>(priority)));
+        push(std::move(job), &counter, priority);
+    }
+
+    void JobSystem::post(std::function<void()> job, JobPriority priority)
+    {
+        push(std::move(job), nullptr, priority);
+    }
+
+    void JobSystem::push(std::function<void()> job, JobCounter* counter, JobPriority priority)
+    {
+        const auto p = static_cast<uint32_t>(priority);
+        const uint32_t queue = t_system == this ? t_queue : static_cast<uint32_t>(m_queues.size() - 1);
+        {
+            // Counted before it is visible, a thief decrements only what was already added
+            std::lock_guard lock(m_queues[queue]->mutex);
+            m_metrics[p].queued.fetch_add(1, std::memory_order_release);
+            m_queues[queue]->jobs[p].push_back({ std::move(job), counter });
+        }
+
+        // Taking the sleep mutex orders the increment with a worker checking it before sleeping
+        {
+            std::lock_guard lock(m_sleepMutex);
+        }
+        // Reserved workers may ignore the class, wake everyone rather than the wrong one
+        if(priority == JobPriority::Background)
+            m_wake.notify_all();
+        else
+            m_wake.notify_one();
+    }
+
+    JobMetrics JobSystem::metrics(JobPriority priority) const
+    {
+        const auto& m = m_metrics[static_cast<uint32_t>(priority)];
+        return { m.queued.load(), m.running.load(), m.executed.load() };
+    }
+
+    bool JobSystem::pop(uint32_t queue, uint32_t priority, Job& job)
+    {
+        // Newest first: the owner keeps working on data that is still in cache
+        auto& q = *m_queues[queue];
+        std::lock_guard lock(q.mutex);
+        auto& jobs = q.jobs[priority];
+        if(jobs.empty())
+            return false;
+        job = std::move(jobs.back());
+        jobs.pop_back();
+        return true;
+    }
+
+    bool JobSystem::steal(uint32_t thief, uint32_t priority, Job& job)
+    {
+        // Oldest first: the largest remaining splits sit at the front
+        const auto count = static_cast<uint32_t>(m_queues.size());
+        for(uint32_t i = 1; i <= count; ++i)
+        {
+            auto& q = *m_queues[(thief + i) % count];
+            std::unique_lock lock(q.mutex, std::try_to_lock);
+            if(!lock.owns_lock() || q.jobs[priority].empty())
+                continue;
+            job = std::move(q.jobs[priority].front());
+            q.jobs[priority].pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    bool JobSystem::hasWork(uint32_t lowest) const
+    {
+        for(uint32_t p = 0; p <= lowest; ++p)
+        {
+            if(m_metrics[p].queued.load(std::memory_order_acquire) > 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool JobSystem::executeOne(uint32_t lowest)
+    {
+        const uint32_t self = t_system == this ? t_queue : static_cast<uint32_t>(m_queues.size() - 1);
+        for(uint32_t p = 0; p <= lowest; ++p)
+        {
+            if(m_metrics[p].queued.load(std::memory_order_acquire) == 0)
+                continue;
+
+            Job job;
+            if(!pop(self, p, job) && !steal(self, p, job))
+                continue;
+
+            auto& metrics = m_metrics[p];
+            metrics.queued.fetch_sub(1, std::memory_order_relaxed);
+            metrics.running.fetch_add(1, std::memory_order_relaxed);
+            job.func();
+            metrics.running.fetch_sub(1, std::memory_order_relaxed);
+            metrics.executed.fetch_add(1, std::memory_order_relaxed);
+            if(job.counter)
+                job.counter->m_pending.fetch_sub(1, std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+
+    void JobSystem::wait(JobCounter& counter)
+    {
+        // A frame waiting on its own jobs must not pick up a long background one
+        while(!counter.done())
+        {
+            if(!executeOne(counter.m_priority.load(std::memory_order_relaxed)))
+                std::this_thread::yield();
+        }
+    }
+
+    void JobSystem::workerLoop(uint32_t index)
+    {
+        t_system = this;
+        t_queue = index;
+        const uint32_t lowest = index < m_reserved ? static_cast<uint32_t>(JobPriority::Interactive) : c_classes - 1;
+        while(m_running)
+        {
+            if(executeOne(lowest))
+                continue;
+
+            // Counters are raised before the push notifies under the sleep mutex, no wakeup is lost
+            std::unique_lock lock(m_sleepMutex);
+            m_wake.wait(lock, [&](){ return !m_running || hasWork(lowest); });
+        }
+    }
+}
@@ -0,0 +1,153 @@
+//
+// Created by loulfy on 17/10/2026.
+//
+
+#ifndef LER_JOB_H
+#define LER_JOB_H
+
+#include "common.hpp"
+#include <array>
+#include <atomic>
+#include <thread>
+#include <coroutine>
+#include <condition_variable>
+
+namespace ler
+{
+    // Strict order: a worker only runs a class once every higher class is empty
+    // Blocking I/O stays on Async::GetPool(), its threads never run jobs
+    enum class JobPriority : uint32_t
+    {
+        Frame,
+        Interactive,
+        Background,
+        Count
+    };
+
+    struct JobMetrics
+    {
+        uint32_t queued = 0;
+        uint32_t running = 0;
+        uint64_t executed = 0;
+    };
+
+    // Counts the children of a fork-join, the parent waits on it
+    class JobCounter
+    {
+    public:
+
+        [[nodiscard]] bool done() const { return m_pending.load(std::memory_order_acquire) == 0; }
+
+    private:
+
+        friend class JobSystem;
+        std::atomic<uint32_t> m_pending = 0;
+        std::atomic<uint32_t> m_priority = static_cast<uint32_t>(JobPriority::Frame);
+    };
+
+    // Work-stealing scheduler for short CPU tasks
+    // Each worker pushes and pops at the back of its own deques, idle workers steal from the front of the others
+    // Threads outside the system submit through shared injection deques
+    // Reserved workers skip background jobs, a long import cannot occupy every thread
+    // Jobs must not throw, catch inside the job and report through captured state
+    class JobSystem
+    {
+    public:
+
+        explicit JobSystem(uint32_t workerCount = std::max(2u, std::thread::hardware_concurrency()) - 1, uint32_t reservedWorkers = 1);
+        ~JobSystem();
+
+        JobSystem(const JobSystem&) = delete;
+        JobSystem& operator=(const JobSystem&) = delete;
+
+        static JobSystem& Get();
+
+        void run(JobCounter& counter, std::function<void()> job, JobPriority priority = JobPriority::Interactive);
+        void post(std::function<void()> job, JobPriority priority = JobPriority::Background);
+        // Executes queued jobs while the counter is pending, never below the priority of its children
+        void wait(JobCounter& counter);
+        [[nodiscard]] uint32_t workerCount() const { return static_cast<uint32_t>(m_threads.size()); }
+        [[nodiscard]] JobMetrics metrics(JobPriority priority) const;
+
+        // Calls func(i) for every i in [0, count), grain consecutive indices per job
+        template <typename F>
+        void parallel_for(size_t count, size_t grain, F&& func, JobPriority priority = JobPriority::Interactive)
+        {
+            if(count == 0)
+                return;
+            grain = std::max<size_t>(1, grain);
+            if(count <= grain)
+            {
+                for(size_t i = 0; i < count; ++i)
+                    func(i);
+                return;
+            }
+
+            JobCounter counter;
+            for(size_t begin = 0; begin < count; begin += grain)
+            {
+                const size_t end = std::min(count, begin + grain);
+                run(counter, [&func, begin, end](){
+                    for(size_t i = begin; i < end; ++i)
+                        func(i);
+                }, priority);
+            }
+            wait(counter);
+        }
+
+        // Continues the coroutine as a job of the given class
+        auto schedule(JobPriority priority)
+        {
+            struct Awaiter
+            {
+                JobSystem* system;
+                JobPriority priority;
+                [[nodiscard]] bool await_ready() const noexcept { return false; }
+                void await_suspend(std::coroutine_handle<> handle) const { system->post([handle](){ handle.resume(); }, priority); }
+                void await_resume() const noexcept {}
+            };
+            return Awaiter{ this, priority };
+        }
+
+    private:
+
+        static constexpr uint32_t c_classes = static_cast<uint32_t>(JobPriority::Count);
+
+        struct Job
+        {
+            std::function<void()> func;
+            JobCounter* counter = nullptr;
+        };
+
+        struct Queue
+        {
+            std::mutex mutex;
+            std::array<std::deque<Job>, c_classes> jobs;
+        };
+
+        struct Metrics
+        {
+            std::atomic<uint32_t> queued = 0;
+            std::atomic<uint32_t> running = 0;
+            std::atomic<uint64_t> executed = 0;
+        };
+
+        void push(std::function<void()> job, JobCounter* counter, JobPriority priority);
+        bool pop(uint32_t queue, uint32_t priority, Job& job);
+        bool steal(uint32_t thief, uint32_t priority, Job& job);
+        bool executeOne(uint32_t lowest);
+        [[nodiscard]] bool hasWork(uint32_t lowest) const;
+        void workerLoop(uint32_t index);
+
+        // One queue per worker, the last one takes submissions from other threads
+        std::vector<std::unique_ptr<Queue>> m_queues;
+        std::vector<std::thread> m_threads;
+        uint32_t m_reserved = 0;
+        std::atomic<bool> m_running = true;
+        std::array<Metrics, c_classes> m_metrics;
+        std::mutex m_sleepMutex;
+        std::condition_variable m_wake;
+    };
+}
+
+#endif //LER_JOB_H
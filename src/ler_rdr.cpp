@@ -24,10 +24,13 @@ namespace ler
 
     void BoxRenderer::render(vk::CommandBuffer cmd, const BatchedMesh& batch, int id)
     {
+        auto const& mesh = batch.meshes[id];
+        if(mesh.box.count == 0)
+            return;
         cmd.bindPipeline(m_pipeline->bindPoint, m_pipeline->handle.get());
-        cmd.bindVertexBuffers(0, 1, &batch.aabbBuffer->handle, &offset);
-        cmd.pushConstants(m_pipeline->pipelineLayout.get(), vk::ShaderStageFlagBits::eVertex, 0, sizeof(ler::SceneConstant), &m_constant);
-        cmd.draw(24, 1, id*24, 0);
+        cmd.bindVertexBuffers(0, 1, &batch.aabbPool.getBuffer(mesh.box.chunk)->handle, &offset);
+        cmd.pushConstants(m_pipeline->pipelineLayout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(ler::SceneConstant), &m_constant);
+        cmd.draw(mesh.box.count, 1, mesh.box.first, 0);
     }
 
     void MeshRenderer::init(LerDevicePtr &device, const RenderPass &renderPass)
@@ -46,10 +49,12 @@ namespace ler
     void MeshRenderer::render(vk::CommandBuffer cmd, const BatchedMesh& batch, int id)
     {
         auto const& mesh = batch.meshes[id];
+        if(mesh.countIndex == 0)
+            return;
         cmd.bindPipeline(m_pipeline->bindPoint, m_pipeline->handle.get());
-        cmd.pushConstants(m_pipeline->pipelineLayout.get(), vk::ShaderStageFlagBits::eVertex, 0, sizeof(ler::SceneConstant), &m_constant);
-        cmd.bindIndexBuffer(batch.indexBuffer->handle, offset, vk::IndexType::eUint32);
-        cmd.bindVertexBuffers(0, 1, &batch.vertexBuffer->handle, &offset);
-        cmd.drawIndexed(mesh.countIndex, 1, mesh.firstIndex, mesh.firstVertex, 0);
+        cmd.pushConstants(m_pipeline->pipelineLayout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(ler::SceneConstant), &m_constant);
+        cmd.bindIndexBuffer(batch.indexPool.getBuffer(mesh.index.chunk)->handle, offset, vk::IndexType::eUint32);
+        cmd.bindVertexBuffers(0, 1, &batch.vertexPool.getBuffer(mesh.vertex.chunk)->handle, &offset);
+        cmd.drawIndexed(mesh.countIndex, 1, mesh.index.first, static_cast<int32_t>(mesh.vertex.first), 0);
     }
 }
\ No newline at end of file
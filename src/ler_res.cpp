@@ -2,4 +2,45 @@
 // Created by loulfy on 29/03/2023.
 //
 
-#include "ler_res.hpp"
\ No newline at end of file
+#include "ler_res.hpp"
+#include "ler_log.hpp"
+
+#include <stb_image.h>
+
+namespace ler
+{
+    CacheLoader::CacheLoader(LerDevicePtr device, uint64_t budget) : m_device(std::move(device)),
+        m_textures(budget, [](const Texture& texture){ return texture.byteSize(); }, [this](TexturePtr texture){ m_device->retire(std::move(texture)); })
+    {
+
+    }
+
+    AsyncRes<TexturePtr> CacheLoader::load(const fs::path& path, JobPriority priority)
+    {
+        auto key = ResourceCache<Texture>::makeKey(path);
+        return m_textures.acquire(key, [path = fs::path(key.path), device = m_device, priority](){ return loadTexture(path, device, priority); });
+    }
+
+    AsyncRes<TexturePtr> CacheLoader::loadTexture(fs::path path, LerDevicePtr device, JobPriority priority)
+    {
+        Blob blob = co_await ReadFileAwaitable(path);
+
+        // Decode off the I/O threads, behind anything the frame is waiting for
+        co_await JobSystem::Get().schedule(priority);
+
+        int w, h, c;
+        auto buff = reinterpret_cast<const stbi_uc*>(blob.data());
+        unsigned char* image = stbi_load_from_memory(buff, static_cast<int>(blob.size()), &w, &h, &c, STBI_rgb_alpha);
+        if(image == nullptr)
+        {
+            log::error("Failed to load texture: {}", path.string());
+            co_return nullptr;
+        }
+
+        auto texture = device->createTexture(vk::Format::eR8G8B8A8Unorm, vk::Extent2D(w, h), vk::SampleCountFlagBits::e1);
+        device->uploadTexture(texture, image, static_cast<uint64_t>(w) * h * 4);
+        stbi_image_free(image);
+        co_await device->transferCompletion(device->flushUploads());
+        co_return texture;
+    }
+}
@@ -6,29 +6,283 @@
 #define LER_RES_H
 
 #include "ler_sys.hpp"
+#include "ler_job.hpp"
 #include "ler_dev.hpp"
 
 namespace ler
 {
-    // TODO: finish cache loader
-    //template <typename Rc>
-    class CacheLoader
+    struct ResourceKey
+    {
+        std::string path;
+        uint64_t options = 0;
+
+        bool operator==(const ResourceKey&) const = default;
+    };
+
+    struct ResourceKeyHash
+    {
+        size_t operator()(const ResourceKey& key) const
+        {
+            uint64_t seed = hashBytes(key.path.data(), key.path.size());
+            hashCombine(seed, key.options);
+            return seed;
+        }
+    };
+
+    // Deduplicates loads by normalized path and import options
+    // Concurrent requests for a key share one load, finished entries are evicted by LRU over a byte budget
+    // Loads capture the cache, it must outlive them
+    // Evicted resources go through the releaser, the GPU may still read them from frames in flight
+    template <typename Rc>
+    class ResourceCache
     {
     public:
 
-        //using Ptr = std::shared_ptr<Texture>;
-        AsyncRes<TexturePtr> load(const std::string& path, LerDevicePtr& device)
+        using Ptr = std::shared_ptr<Rc>;
+        using Loader = std::function<AsyncRes<Ptr>()>;
+        using Sizer = std::function<uint64_t(const Rc&)>;
+        using Releaser = std::function<void(Ptr)>;
+
+        ResourceCache(uint64_t budget, Sizer sizer, Releaser releaser = nullptr) : m_budget(budget), m_sizer(std::move(sizer)), m_releaser(std::move(releaser)) {}
+
+        static ResourceKey makeKey(const fs::path& path, uint64_t options = 0)
+        {
+            return { path.lexically_normal().relative_path().generic_string(), options };
+        }
+
+        AsyncRes<Ptr> acquire(ResourceKey key, Loader loader)
+        {
+            std::shared_ptr<Slot> slot;
+            bool owner = false;
+            {
+                std::lock_guard lock(m_mutex);
+                auto it = m_entries.find(key);
+                if(it != m_entries.end())
+                {
+                    m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+                    slot = it->second.slot;
+                }
+                else
+                {
+                    slot = std::make_shared<Slot>();
+                    m_lru.push_front(key);
+                    m_entries.emplace(key, Entry{ slot, 0, m_lru.begin() });
+                    owner = true;
+                }
+            }
+
+            if(!owner)
+                co_return co_await SlotAwaitable{ slot };
+
+            Ptr value;
+            std::exception_ptr error;
+            try
+            {
+                value = co_await loader();
+            }
+            catch(...)
+            {
+                error = std::current_exception();
+            }
+
+            {
+                std::lock_guard lock(m_mutex);
+                auto it = m_entries.find(key);
+                if(it != m_entries.end() && it->second.slot == slot)
+                {
+                    // Failed loads are not cached, the next request tries again
+                    if(error || !value)
+                    {
+                        m_lru.erase(it->second.lru);
+                        m_entries.erase(it);
+                    }
+                    else
+                    {
+                        it->second.bytes = m_sizer(*value);
+                        m_used += it->second.bytes;
+                    }
+                }
+                evict();
+            }
+
+            slot->publish(value, error);
+            if(error)
+                std::rethrow_exception(error);
+            co_return value;
+        }
+
+        void setBudget(uint64_t budget)
+        {
+            std::lock_guard lock(m_mutex);
+            m_budget = budget;
+            evict();
+        }
+
+        [[nodiscard]] uint64_t used() const
+        {
+            std::lock_guard lock(m_mutex);
+            return m_used;
+        }
+
+        // Drops unreferenced entries from the cold end until the byte count is reached
+        uint64_t trim(uint64_t bytes)
+        {
+            std::lock_guard lock(m_mutex);
+            const uint64_t used = m_used;
+            const uint64_t budget = m_budget;
+            m_budget = used > bytes ? used - bytes : 0;
+            evict();
+            m_budget = budget;
+            return used - m_used;
+        }
+
+        void clear()
         {
-            if(saved.contains(path))
-                co_return saved.at(path);
-            co_await ReadFileAwaitable();
-            auto t = device->createTexture(vk::Format::eR8G8B8A8Unorm, vk::Extent2D(200,200), vk::SampleCountFlagBits::e1);
-            co_return t;
+            std::lock_guard lock(m_mutex);
+            for(auto& [key, entry] : m_entries)
+            {
+                std::lock_guard slotLock(entry.slot->mutex);
+                release(std::move(entry.slot->value));
+            }
+            m_entries.clear();
+            m_lru.clear();
+            m_used = 0;
         }
 
     private:
 
-        std::map<std::string, TexturePtr> saved;
+        struct Waiter
+        {
+            std::coroutine_handle<> handle;
+            Ptr* value = nullptr;
+            std::exception_ptr* error = nullptr;
+        };
+
+        struct Slot
+        {
+            std::mutex mutex;
+            bool ready = false;
+            Ptr value;
+            std::exception_ptr error;
+            std::vector<Waiter> waiters;
+
+            void publish(const Ptr& res, const std::exception_ptr& err)
+            {
+                // Hand the result to each waiter now, evict() may move value out before they resume
+                std::vector<Waiter> pending;
+                {
+                    std::lock_guard lock(mutex);
+                    value = res;
+                    error = err;
+                    ready = true;
+                    for(auto& waiter : waiters)
+                    {
+                        *waiter.value = res;
+                        *waiter.error = err;
+                    }
+                    pending.swap(waiters);
+                }
+                for(auto& waiter : pending)
+                    Async::GetPool().push_task([handle = waiter.handle](){ handle.resume(); });
+            }
+        };
+
+        struct SlotAwaitable
+        {
+            std::shared_ptr<Slot> slot;
+            Ptr value;
+            std::exception_ptr error;
+
+            [[nodiscard]] bool await_ready()
+            {
+                std::lock_guard lock(slot->mutex);
+                if(!slot->ready)
+                    return false;
+                value = slot->value;
+                error = slot->error;
+                return true;
+            }
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                std::lock_guard lock(slot->mutex);
+                if(slot->ready)
+                {
+                    value = slot->value;
+                    error = slot->error;
+                    return false;
+                }
+                slot->waiters.push_back({ handle, &value, &error });
+                return true;
+            }
+            Ptr await_resume()
+            {
+                if(error)
+                    std::rethrow_exception(error);
+                return std::move(value);
+            }
+        };
+
+        struct Entry
+        {
+            std::shared_ptr<Slot> slot;
+            uint64_t bytes = 0;
+            typename std::list<ResourceKey>::iterator lru;
+        };
+
+        void evict()
+        {
+            // Caller must hold m_mutex
+            // Skip loads in flight and resources still referenced outside, dropping them frees nothing
+            // A slot held outside the cache has a requester that has not read its value yet
+            auto it = m_lru.end();
+            while(m_used > m_budget && it != m_lru.begin())
+            {
+                --it;
+                auto& entry = m_entries.at(*it);
+                if(entry.slot.use_count() > 1)
+                    continue;
+                std::unique_lock lock(entry.slot->mutex);
+                if(!entry.slot->ready || entry.slot->value.use_count() > 1)
+                    continue;
+                release(std::move(entry.slot->value));
+                lock.unlock();
+
+                m_used -= entry.bytes;
+                m_entries.erase(*it);
+                it = m_lru.erase(it);
+            }
+        }
+
+        void release(Ptr value)
+        {
+            if(value && m_releaser)
+                m_releaser(std::move(value));
+        }
+
+        mutable std::mutex m_mutex;
+        std::unordered_map<ResourceKey, Entry, ResourceKeyHash> m_entries;
+        std::list<ResourceKey> m_lru;
+        uint64_t m_budget = 0;
+        uint64_t m_used = 0;
+        Sizer m_sizer;
+        Releaser m_releaser;
+    };
+
+    class CacheLoader
+    {
+    public:
+
+        explicit CacheLoader(LerDevicePtr device, uint64_t budget = 512ull * 1024 * 1024);
+        // Prefetches pass JobPriority::Background, a load already in flight keeps its class
+        AsyncRes<TexturePtr> load(const fs::path& path, JobPriority priority = JobPriority::Interactive);
+        uint64_t trim(uint64_t bytes) { return m_textures.trim(bytes); }
+
+    private:
+
+        static AsyncRes<TexturePtr> loadTexture(fs::path path, LerDevicePtr device, JobPriority priority);
+
+        LerDevicePtr m_device;
+        ResourceCache<Texture> m_textures;
     };
 }
 
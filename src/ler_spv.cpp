@@ -4,6 +4,7 @@
 
 #include "ler_spv.hpp"
 #include "ler_sys.hpp"
+#include "ler_job.hpp"
 #include "ler_log.hpp"
 
 #include <glslang/Public/ResourceLimits.h>
@@ -11,6 +12,14 @@
 #include <SPIRV/GlslangToSpv.h>
 #include <SPIRV/doc.h>
 
+#define SPIRV_REFLECT_HAS_VULKAN_H
+#include <spirv_reflect.h>
+
+#include <sstream>
+#include <cstring>
+
+static const fs::path SHADER_MANIFEST = ler::CACHED_DIR / "shaders.manifest";
+
 namespace ler
 {
     struct KindMapping
@@ -26,6 +35,80 @@ namespace ler
         {".comp", EShLanguage::EShLangCompute}
     }};
 
+    static constexpr int c_glslVersion = 460;
+    static constexpr EShMessages c_controls = static_cast<EShMessages>(
+        EShMsgCascadingErrors | EShMsgDebugInfo | EShMsgSpvRules | EShMsgKeepUncalled | EShMsgVulkanRules);
+
+    static constexpr uint32_t c_reflectMagic = 0x4C46524C; // 'LRFL'
+    static constexpr uint32_t c_reflectVersion = 1;
+
+    static const std::array<std::set<std::string>, 5> c_VertexAttrMap =
+    {{
+             {"inPos"},
+             {"inTex", "inUV"},
+             {"inNormal"},
+             {"inTangent"},
+             {"inColor"}
+     }};
+
+    struct ShaderRecord
+    {
+        uint64_t key = 0;
+        std::vector<fs::path> includes;
+    };
+
+    struct ShaderJob
+    {
+        ShaderRecord record;
+        std::string errors;
+        bool compiled = false;
+    };
+
+    using ShaderManifest = std::map<std::string, ShaderRecord>;
+
+    class FileSystemIncluder : public glslang::TShader::Includer
+    {
+    public:
+
+        IncludeResult* includeLocal(const char* headerName, const char* includerName, size_t depth) override
+        {
+            fs::path local = fs::path(includerName).parent_path() / headerName;
+            auto result = include(local.lexically_normal());
+            return result ? result : includeSystem(headerName, includerName, depth);
+        }
+
+        IncludeResult* includeSystem(const char* headerName, const char* includerName, size_t depth) override
+        {
+            return include(fs::path(headerName).lexically_normal());
+        }
+
+        void releaseInclude(IncludeResult* result) override
+        {
+            if(result == nullptr)
+                return;
+            delete static_cast<std::string*>(result->userData);
+            delete result;
+        }
+
+        // Every header resolved while parsing, in first-seen order
+        std::vector<fs::path> includes;
+
+    private:
+
+        IncludeResult* include(const fs::path& path)
+        {
+            auto& fs = FileSystemService::Get();
+            if(!fs.exists(path))
+                return nullptr;
+
+            auto blob = fs.readFile(path);
+            auto content = new std::string(blob.begin(), blob.end());
+            if(std::find(includes.begin(), includes.end(), path) == includes.end())
+                includes.push_back(path);
+            return new IncludeResult(path.generic_string(), content->data(), content->size(), content);
+        }
+    };
+
     std::optional<KindMapping> convertShaderExtension(const fs::path& ext)
     {
         for(auto& map : c_KindMap)
@@ -44,13 +127,157 @@ namespace ler
         glslang::FinalizeProcess();
     }
 
-    bool compile(glslang::TShader* shader, const std::string& code, EShMessages controls, const std::string& shaderName, const std::string& entryPointName = "main")
+    uint32_t guessVertexInputBinding(const char* name)
+    {
+        for(size_t i = 0; i < c_VertexAttrMap.size(); ++i)
+            if(c_VertexAttrMap[i].contains(name))
+                return i;
+        throw std::runtime_error("Vertex Input Attribute not reserved");
+    }
+
+    bool reflectSpirv(std::span<const char> spirv, ShaderReflection& reflection)
+    {
+        uint32_t count = 0;
+        SpvReflectShaderModule module;
+        SpvReflectResult result = spvReflectCreateShaderModule(spirv.size(), spirv.data(), &module);
+        if(result != SPV_REFLECT_RESULT_SUCCESS)
+            return false;
+        assert(module.generator == SPV_REFLECT_GENERATOR_KHRONOS_GLSLANG_REFERENCE_FRONT_END);
+
+        reflection = ShaderReflection();
+        reflection.stage = module.shader_stage;
+
+        // Input Variables
+        result = spvReflectEnumerateInputVariables(&module, &count, nullptr);
+        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+
+        std::vector<SpvReflectInterfaceVariable*> inputs(count);
+        result = spvReflectEnumerateInputVariables(&module, &count, inputs.data());
+        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+
+        if (module.shader_stage == SPV_REFLECT_SHADER_STAGE_VERTEX_BIT)
+        {
+            for(auto& in : inputs)
+            {
+                if(in->decoration_flags & SPV_REFLECT_DECORATION_BUILT_IN)
+                    continue;
+
+                uint32_t binding = guessVertexInputBinding(in->name);
+                reflection.attributes.push_back({in->location, binding, static_cast<uint32_t>(in->format)});
+            }
+
+            std::sort(reflection.attributes.begin(), reflection.attributes.end(),
+                [](const ShaderReflection::Attribute& a, const ShaderReflection::Attribute& b) {
+                    return a.location < b.location;
+            });
+        }
+
+        // Push Constants
+        result = spvReflectEnumeratePushConstantBlocks(&module, &count, nullptr);
+        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+
+        std::vector<SpvReflectBlockVariable*> constants(count);
+        result = spvReflectEnumeratePushConstantBlocks(&module, &count, constants.data());
+        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+
+        for(auto& block : constants)
+            reflection.pushConstants.push_back({block->offset, block->size});
+
+        // Descriptor Set
+        result = spvReflectEnumerateDescriptorSets(&module, &count, nullptr);
+        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+
+        std::vector<SpvReflectDescriptorSet*> sets(count);
+        result = spvReflectEnumerateDescriptorSets(&module, &count, sets.data());
+        assert(result == SPV_REFLECT_RESULT_SUCCESS);
+
+        for(auto& set : sets)
+        {
+            for(size_t i = 0; i < set->binding_count; ++i)
+            {
+                auto binding = set->bindings[i];
+                reflection.bindings.push_back({set->set, binding->binding, binding->count, static_cast<uint32_t>(binding->descriptor_type)});
+            }
+        }
+
+        spvReflectDestroyShaderModule(&module);
+        return true;
+    }
+
+    template <typename T>
+    void writeArray(std::vector<char>& out, const std::vector<T>& items)
+    {
+        auto count = static_cast<uint32_t>(items.size());
+        out.insert(out.end(), reinterpret_cast<const char*>(&count), reinterpret_cast<const char*>(&count + 1));
+        auto bytes = reinterpret_cast<const char*>(items.data());
+        out.insert(out.end(), bytes, bytes + items.size() * sizeof(T));
+    }
+
+    template <typename T>
+    bool readArray(std::span<const char>& in, std::vector<T>& items)
+    {
+        uint32_t count = 0;
+        if(in.size() < sizeof(count))
+            return false;
+        std::memcpy(&count, in.data(), sizeof(count));
+        in = in.subspan(sizeof(count));
+        if(in.size() < count * sizeof(T))
+            return false;
+        items.resize(count);
+        std::memcpy(items.data(), in.data(), count * sizeof(T));
+        in = in.subspan(count * sizeof(T));
+        return true;
+    }
+
+    std::vector<char> writeReflection(const ShaderReflection& reflection, uint64_t spirvHash)
+    {
+        // Header: magic, version, stage, hash of the SPIR-V it describes
+        std::vector<char> out;
+        std::array<uint32_t, 3> header = { c_reflectMagic, c_reflectVersion, reflection.stage };
+        out.insert(out.end(), reinterpret_cast<const char*>(header.data()), reinterpret_cast<const char*>(header.data() + header.size()));
+        out.insert(out.end(), reinterpret_cast<const char*>(&spirvHash), reinterpret_cast<const char*>(&spirvHash + 1));
+        writeArray(out, reflection.attributes);
+        writeArray(out, reflection.pushConstants);
+        writeArray(out, reflection.bindings);
+        return out;
+    }
+
+    bool readReflection(std::span<const char> data, uint64_t spirvHash, ShaderReflection& reflection)
+    {
+        std::array<uint32_t, 3> header = {};
+        uint64_t hash = 0;
+        if(data.size() < sizeof(header) + sizeof(hash))
+            return false;
+        std::memcpy(header.data(), data.data(), sizeof(header));
+        std::memcpy(&hash, data.data() + sizeof(header), sizeof(hash));
+        if(header[0] != c_reflectMagic || header[1] != c_reflectVersion || hash != spirvHash)
+            return false;
+
+        reflection.stage = header[2];
+        data = data.subspan(sizeof(header) + sizeof(hash));
+        return readArray(data, reflection.attributes) && readArray(data, reflection.pushConstants) && readArray(data, reflection.bindings);
+    }
+
+    void writeReflectionFile(const fs::path& output, std::span<const char> spirv)
+    {
+        ShaderReflection reflection;
+        if(!reflectSpirv(spirv, reflection))
+            return;
+
+        fs::path record = output;
+        record.concat(".refl");
+        auto data = writeReflection(reflection, hashBytes(spirv.data(), spirv.size()));
+        std::ofstream fout(record, std::ios_base::binary);
+        fout.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+    bool compile(glslang::TShader* shader, const std::string& code, const std::string& preamble, glslang::TShader::Includer& includer, const std::string& shaderName, const std::string& entryPointName = "main")
     {
         const char* shaderStrings = code.data();
         const int shaderLengths = static_cast<int>(code.size());
         const char* shaderNames = nullptr;
 
-        if (controls & EShMsgDebugInfo)
+        if (c_controls & EShMsgDebugInfo)
         {
             shaderNames = shaderName.data();
             shader->setStringsWithLengthsAndNames(&shaderStrings, &shaderLengths, &shaderNames, 1);
@@ -63,38 +290,58 @@ namespace ler
         if (!entryPointName.empty())
             shader->setEntryPoint(entryPointName.c_str());
 
-        return shader->parse(GetDefaultResources(), 460, false, controls);
+        if (!preamble.empty())
+            shader->setPreamble(preamble.c_str());
+
+        return shader->parse(GetDefaultResources(), c_glslVersion, false, c_controls, includer);
     }
 
     std::vector<uint32_t> compileGlslToSpv(const std::string& code, const fs::path& name)
+    {
+        ShaderCompileInfo info;
+        auto spv = compileGlslToSpv(code, name, info);
+        if(!info.errors.empty())
+            log::error(info.errors);
+        return spv;
+    }
+
+    std::vector<uint32_t> compileGlslToSpv(const std::string& code, const fs::path& name, ShaderCompileInfo& info)
     {
         auto stage = convertShaderExtension(name.extension());
         if(!stage.has_value())
             return {};
 
+        // Defines are either NAME or NAME=VALUE
+        std::string preamble;
+        for(const auto& define : info.defines)
+        {
+            auto pos = define.find('=');
+            preamble += "#define " + define.substr(0, pos);
+            if(pos != std::string::npos)
+                preamble += " " + define.substr(pos + 1);
+            preamble += "\n";
+        }
+
         bool success = true;
+        FileSystemIncluder includer;
         glslang::TShader shader(stage.value().kind);
-        EShMessages controls = EShMsgCascadingErrors;
-        controls = static_cast<EShMessages>(controls | EShMsgDebugInfo);
-        controls = static_cast<EShMessages>(controls | EShMsgSpvRules);
-        controls = static_cast<EShMessages>(controls | EShMsgKeepUncalled);
-        controls = static_cast<EShMessages>(controls | EShMsgVulkanRules | EShMsgSpvRules);
-        success &= compile(&shader, code, controls, name.string());
+        success &= compile(&shader, code, preamble, includer, name.generic_string());
+        info.includes = includer.includes;
 
         if(!success)
         {
-            log::error(shader.getInfoLog());
+            info.errors = shader.getInfoLog();
             return {};
         }
 
         // Link all of them.
         glslang::TProgram program;
         program.addShader(&shader);
-        success &= program.link(controls);
+        success &= program.link(c_controls);
 
         if(!success)
         {
-            log::error(program.getInfoLog());
+            info.errors = program.getInfoLog();
             return {};
         }
 
@@ -104,54 +351,227 @@ namespace ler
         options.disableOptimizer = false;
         options.optimizeSize = true;
         glslang::GlslangToSpv(*program.getIntermediate(shader.getStage()), spv, &logger, &options);
-        if(!logger.getAllMessages().empty())
-            log::error(logger.getAllMessages());
+        info.errors = logger.getAllMessages();
         return spv;
     }
 
-    void compileFile(const fs::path& input, const fs::path& output)
+    uint64_t hashShader(const std::string& code, const std::vector<fs::path>& includes, const std::vector<std::string>& defines)
     {
-        /*std::ifstream fin(input);
-        std::stringstream src;
-        src << fin.rdbuf();
-        fin.close();*/
+        // Anything that changes the generated SPIR-V must be part of the key
+        // The key is persisted in the manifest, only hashBytes chaining keeps it stable across builds
+        auto hashValue = [](uint64_t value, uint64_t key){ return hashBytes(&value, sizeof(value), key); };
+        auto hashString = [&](const std::string& str, uint64_t key){ return hashBytes(str.data(), str.size(), hashValue(str.size(), key)); };
+
+        uint64_t key = hashBytes(code.data(), code.size());
+        key = hashValue(static_cast<uint64_t>(c_glslVersion), key);
+        key = hashValue(static_cast<uint64_t>(c_controls), key);
+        for(const auto& define : defines)
+            key = hashString(define, key);
+
+        auto& fs = FileSystemService::Get();
+        for(const auto& include : includes)
+        {
+            key = hashString(include.generic_string(), key);
+            if(!fs.exists(include))
+            {
+                key = hashValue(0, key);
+                continue;
+            }
+
+            auto blob = fs.readFile(include);
+            key = hashValue(1, key);
+            key = hashBytes(blob.data(), blob.size(), key);
+        }
+        return key;
+    }
+
+    ShaderManifest loadShaderManifest()
+    {
+        // One line per shader: key, source path, then each include, tab separated
+        ShaderManifest manifest;
+        std::ifstream file(SHADER_MANIFEST);
+        std::string line;
+        while(std::getline(file, line))
+        {
+            std::string field;
+            std::istringstream fields(line);
+            ShaderRecord record;
+            if(!std::getline(fields, field, '\t'))
+                continue;
+            try
+            {
+                record.key = std::stoull(field, nullptr, 16);
+            }
+            catch(const std::exception&)
+            {
+                continue;
+            }
+            std::string source;
+            if(!std::getline(fields, source, '\t'))
+                continue;
+            while(std::getline(fields, field, '\t'))
+                record.includes.emplace_back(field);
+            manifest.emplace(source, std::move(record));
+        }
+        return manifest;
+    }
+
+    void saveShaderManifest(const ShaderManifest& manifest)
+    {
+        fs::path tmp = SHADER_MANIFEST;
+        tmp.concat(".tmp");
+        {
+            std::ofstream file(tmp, std::ios::out | std::ios::trunc);
+            for(const auto& [source, record] : manifest)
+            {
+                file << std::hex << record.key << std::dec << '\t' << source;
+                for(const auto& include : record.includes)
+                    file << '\t' << include.generic_string();
+                file << '\n';
+            }
+        }
 
+        std::error_code ec;
+        fs::rename(tmp, SHADER_MANIFEST, ec);
+        if(ec)
+            log::warn("Failed to save shader manifest: {}", ec.message());
+    }
+
+    ShaderJob compileFile(const fs::path& input, const fs::path& output, const std::vector<std::string>& defines, const ShaderRecord& previous)
+    {
+        ShaderJob job;
         const auto blob = FileSystemService::Get().readFile(input);
         std::string src(blob.begin(), blob.end());
 
-        auto spv = compileGlslToSpv(src, input.filename().string());
+        // The previous include list is enough: a new include means the source or a header changed
+        uint64_t key = hashShader(src, previous.includes, defines);
+        if(key == previous.key && fs::exists(output))
+        {
+            fs::path record = output;
+            record.concat(".refl");
+            if(!fs::exists(record))
+            {
+                std::ifstream fin(output, std::ios_base::binary);
+                std::vector<char> spv((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+                writeReflectionFile(output, spv);
+            }
+            job.record = previous;
+            return job;
+        }
+
+        log::warn("Compile {}", output.string());
+        ShaderCompileInfo info;
+        info.defines = defines;
+        auto spv = compileGlslToSpv(src, input, info);
+        job.errors = info.errors;
 
         if(spv.empty())
-            return;
+            return job;
 
         std::ofstream fout(output, std::ios_base::binary);
         auto size = static_cast<std::streamsize>(spv.size() * sizeof(uint32_t));
         fout.write(reinterpret_cast<const char*>(spv.data()), size);
         fout.close();
+        writeReflectionFile(output, { reinterpret_cast<const char*>(spv.data()), static_cast<size_t>(size) });
+
+        job.record.key = hashShader(src, info.includes, defines);
+        job.record.includes = std::move(info.includes);
+        job.compiled = true;
+        return job;
     }
 
-    void shaderAutoCompile()
+    std::vector<fs::path> compileShaders(const std::vector<fs::path>& sources, const std::vector<std::string>& defines, ShaderManifest& manifest, JobPriority priority)
     {
-        fs::create_directory(CACHED_DIR);
         auto& fs = FileSystemService::Get();
-        std::vector<fs::path> entries;
-        fs.enumerates(entries);
-        for(const auto& entry : entries)
-        //for (const auto& entry : fs::directory_iterator(ASSETS_DIR))
-        {
-            auto res = convertShaderExtension(entry.extension());
-            if(!res.has_value())
-                continue;
+        std::vector<ShaderRecord> previous;
+        previous.reserve(sources.size());
+        for(const auto& entry : sources)
+            previous.push_back(manifest[entry.generic_string()]);
 
-            fs::path f = CACHED_DIR / entry.filename();
+        // glslang compiles independent shaders concurrently once the process is initialized
+        std::vector<ShaderJob> jobs(sources.size());
+        JobSystem::Get().parallel_for(sources.size(), 1, [&](size_t i){
+            fs::path f = CACHED_DIR / sources[i].filename();
             f.concat(".spv");
-            //if(fs::exists(f) && fs::last_write_time(f) > entry.last_write_time())
-                //continue;
-            if(fs::exists(f) && fs::last_write_time(f) > fs.last_write_time(entry))
+            f.make_preferred();
+            try
+            {
+                jobs[i] = compileFile(sources[i], f, defines, previous[i]);
+            }
+            catch(const std::exception& e)
+            {
+                jobs[i].errors = e.what();
+            }
+        }, priority);
+
+        // Report errors in submission order
+        std::vector<fs::path> outputs;
+        for(size_t i = 0; i < sources.size(); ++i)
+        {
+            const auto& entry = sources[i];
+            auto& result = jobs[i];
+            if(!result.errors.empty())
+                log::error("{}: {}", entry.string(), result.errors);
+            manifest[entry.generic_string()] = std::move(result.record);
+
+            // Outputs are served through the cache mount, refresh their index entries
+            fs::path output = entry.filename();
+            output.concat(".spv");
+            fs.invalidate(output);
+            fs::path record = output;
+            fs.invalidate(record.concat(".refl"));
+            if(result.compiled)
+                outputs.push_back(output);
+        }
+
+        return outputs;
+    }
+
+    void shaderAutoCompile(const std::vector<std::string>& defines)
+    {
+        fs::create_directory(CACHED_DIR);
+        auto manifest = loadShaderManifest();
+        std::vector<FileEntry> entries;
+        std::vector<fs::path> sources;
+        FileSystemService::Get().enumerates(entries);
+        for(const auto& file : entries)
+        {
+            if(convertShaderExtension(file.path.extension()).has_value())
+                sources.push_back(file.path);
+        }
+
+        compileShaders(sources, defines, manifest, JobPriority::Interactive);
+        saveShaderManifest(manifest);
+    }
+
+    std::vector<fs::path> shaderRecompile(const std::vector<fs::path>& changed, const std::vector<std::string>& defines)
+    {
+        // A source is affected when it changed itself or when one of its recorded includes did
+        auto manifest = loadShaderManifest();
+        std::set<fs::path> modified(changed.begin(), changed.end());
+        auto& fs = FileSystemService::Get();
+        std::vector<fs::path> sources;
+        for(const auto& [source, record] : manifest)
+        {
+            if(!fs.exists(source))
                 continue;
+            if(modified.contains(source) || std::ranges::any_of(record.includes, [&](const fs::path& include){ return modified.contains(include); }))
+                sources.emplace_back(source);
+        }
 
-            log::warn("Compile {}", f.make_preferred().string());
-            compileFile(entry, f);
+        // New shaders are not in the manifest yet
+        for(const auto& path : changed)
+        {
+            if(!manifest.contains(path.generic_string()) && convertShaderExtension(path.extension()).has_value() && fs.exists(path))
+                sources.push_back(path);
         }
+
+        if(sources.empty())
+            return {};
+
+        // Hot reload runs inside the frame, which waits for it
+        auto outputs = compileShaders(sources, defines, manifest, JobPriority::Frame);
+        saveShaderManifest(manifest);
+        return outputs;
     }
-}
\ No newline at end of file
+}
@@ -17,8 +17,33 @@ namespace ler
         ~GlslangInitializer();
     };
 
+    struct ShaderCompileInfo
+    {
+        std::vector<std::string> defines;
+        std::vector<fs::path> includes;
+        std::string errors;
+    };
+
+    struct ShaderReflection
+    {
+        struct Attribute { uint32_t location; uint32_t binding; uint32_t format; };
+        struct PushConstant { uint32_t offset; uint32_t size; };
+        struct Binding { uint32_t set; uint32_t binding; uint32_t count; uint32_t type; };
+
+        uint32_t stage = 0;
+        std::vector<Attribute> attributes;
+        std::vector<PushConstant> pushConstants;
+        std::vector<Binding> bindings;
+    };
+
+    bool reflectSpirv(std::span<const char> spirv, ShaderReflection& reflection);
+    bool readReflection(std::span<const char> data, uint64_t spirvHash, ShaderReflection& reflection);
+    std::vector<char> writeReflection(const ShaderReflection& reflection, uint64_t spirvHash);
+
     std::vector<uint32_t> compileGlslToSpv(const std::string& code, const fs::path& name);
-    void shaderAutoCompile();
+    std::vector<uint32_t> compileGlslToSpv(const std::string& code, const fs::path& name, ShaderCompileInfo& info);
+    void shaderAutoCompile(const std::vector<std::string>& defines = {});
+    std::vector<fs::path> shaderRecompile(const std::vector<fs::path>& changed, const std::vector<std::string>& defines = {});
 }
 
 #endif //LER_SPV_H
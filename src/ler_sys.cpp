@@ -7,6 +7,7 @@
 
 #include <miniz.h>
 #include <miniz_zip.h>
+#include <cstring>
 
 #ifdef _WIN32
     #include <Windows.h>
@@ -14,6 +15,17 @@
 #else
     #include <unistd.h>
     #include <pwd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#ifdef LER_HAS_IO_URING
+    #include <liburing.h>
+#endif
+
+#ifdef __linux__
+    #include <sys/inotify.h>
 #endif
 
 namespace ler
@@ -37,6 +49,415 @@ namespace ler
         return {};
     }
 
+    uint64_t hashBytes(const void* data, size_t size, uint64_t seed)
+    {
+        // FNV-1a, stable across runs and platforms
+        auto bytes = static_cast<const unsigned char*>(data);
+        for(size_t i = 0; i < size; ++i)
+        {
+            seed ^= bytes[i];
+            seed *= 1099511628211ull;
+        }
+        return seed;
+    }
+
+    MappedFile::MappedFile(const fs::path& path)
+    {
+        #ifdef _WIN32
+        m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if(m_file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("File Not Found: " + path.string());
+
+        LARGE_INTEGER size;
+        GetFileSizeEx(m_file, &size);
+        m_size = static_cast<size_t>(size.QuadPart);
+        if(m_size == 0)
+            return;
+
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(m_mapping != nullptr)
+            m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        #else
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            throw std::runtime_error("File Not Found: " + path.string());
+
+        struct stat st = {};
+        fstat(fd, &st);
+        m_size = static_cast<size_t>(st.st_size);
+        if(m_size == 0)
+        {
+            close(fd);
+            return;
+        }
+
+        // The mapping keeps the file referenced, the descriptor is no longer needed
+        void* addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(addr != MAP_FAILED)
+        {
+            madvise(addr, m_size, MADV_SEQUENTIAL);
+            madvise(addr, m_size, MADV_WILLNEED);
+            m_data = static_cast<const char*>(addr);
+        }
+        #endif
+
+        if(m_data == nullptr)
+            throw std::runtime_error("Failed to map file: " + path.string());
+    }
+
+    MappedFile::~MappedFile()
+    {
+        #ifdef _WIN32
+        if(m_data)
+            UnmapViewOfFile(m_data);
+        if(m_mapping)
+            CloseHandle(m_mapping);
+        if(m_file && m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        #else
+        if(m_data)
+            munmap(const_cast<char*>(m_data), m_size);
+        #endif
+    }
+
+    Blob Blob::allocate(size_t size)
+    {
+        // new char[] leaves the bytes uninitialized
+        std::shared_ptr<char[]> storage(new char[size]);
+        char* data = storage.get();
+        return { std::move(storage), data, size };
+    }
+
+    Blob Blob::allocate(size_t size, std::shared_ptr<std::pmr::memory_resource> resource)
+    {
+        // The deleter keeps the resource alive as long as the blob
+        constexpr size_t alignment = alignof(std::max_align_t);
+        char* data = static_cast<char*>(resource->allocate(size, alignment));
+        std::shared_ptr<char> storage(data, [resource, size](char* p){ resource->deallocate(p, size, alignment); });
+        return { std::move(storage), data, size };
+    }
+
+    Blob Blob::map(const fs::path& path)
+    {
+        auto file = std::make_shared<MappedFile>(path);
+        // Pages are mapped read-only, the pointer is only handed out as const
+        char* data = const_cast<char*>(file->data());
+        size_t size = file->size();
+        return { std::move(file), data, size, true };
+    }
+
+    static std::future<Blob> readyBlob(Blob blob = {})
+    {
+        std::promise<Blob> promise;
+        promise.set_value(std::move(blob));
+        return promise.get_future();
+    }
+
+    template <typename Key>
+    static std::vector<std::future<Blob>> readSorted(IFileSystem* system, std::span<const fs::path> paths, Key key)
+    {
+        // Submit in key order so the pool issues reads in that order, return in path order
+        std::vector<size_t> order(paths.size());
+        std::vector<uint64_t> keys(paths.size());
+        for(size_t i = 0; i < paths.size(); ++i)
+        {
+            order[i] = i;
+            keys[i] = key(paths[i]);
+        }
+        std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b){ return keys[a] < keys[b]; });
+
+        std::vector<std::future<Blob>> futures(paths.size());
+        for(size_t i : order)
+            futures[i] = system->readFileAsync(paths[i]);
+        return futures;
+    }
+
+    // Stream over bytes already in memory: whole files and stored archive entries
+    class BlobStream : public IFileStream
+    {
+    public:
+
+        explicit BlobStream(Blob blob) : m_blob(std::move(blob)) {}
+
+        size_t read(char* dst, size_t size) override
+        {
+            size_t count = std::min<uint64_t>(size, m_blob.size() - m_position);
+            std::memcpy(dst, m_blob.data() + m_position, count);
+            m_position += count;
+            return count;
+        }
+
+        void skip(uint64_t count) override { m_position = std::min<uint64_t>(m_position + count, m_blob.size()); }
+        [[nodiscard]] uint64_t size() const override { return m_blob.size(); }
+        [[nodiscard]] uint64_t tell() const override { return m_position; }
+
+    private:
+
+        Blob m_blob;
+        uint64_t m_position = 0;
+    };
+
+    // Inflates a raw deflate entry through the 32 KiB dictionary, memory stays bounded
+    // The size, and the CRC when the container has one, are checked once the stream ends
+    class InflateStream : public IFileStream
+    {
+    public:
+
+        InflateStream(Blob compressed, uint64_t size, std::optional<uint32_t> crc = std::nullopt) : m_input(std::move(compressed)), m_size(size), m_expectedCrc(crc), m_dict(TINFL_LZ_DICT_SIZE)
+        {
+            tinfl_init(&m_inflator);
+        }
+
+        size_t read(char* dst, size_t size) override
+        {
+            size_t total = 0;
+            while(total < size)
+            {
+                if(m_pendingSize == 0)
+                {
+                    if(m_status <= TINFL_STATUS_DONE)
+                    {
+                        verify(total);
+                        break;
+                    }
+
+                    // Decode up to the end of the dictionary, the produced bytes are contiguous
+                    size_t in = m_input.size() - m_inputPos;
+                    size_t out = TINFL_LZ_DICT_SIZE - m_dictPos;
+                    auto input = reinterpret_cast<const mz_uint8*>(m_input.data()) + m_inputPos;
+                    m_status = tinfl_decompress(&m_inflator, input, &in, m_dict.data(), m_dict.data() + m_dictPos, &out, 0);
+                    m_inputPos += in;
+                    m_pendingStart = m_dictPos;
+                    m_pendingSize = out;
+                    m_dictPos = (m_dictPos + out) & (TINFL_LZ_DICT_SIZE - 1);
+                    if(m_status < TINFL_STATUS_DONE || (in == 0 && out == 0 && m_status != TINFL_STATUS_DONE))
+                    {
+                        log::warn("Corrupted deflate stream");
+                        m_status = TINFL_STATUS_FAILED;
+                    }
+                    continue;
+                }
+
+                size_t count = std::min(m_pendingSize, size - total);
+                std::memcpy(dst + total, m_dict.data() + m_pendingStart, count);
+                m_crc = static_cast<uint32_t>(mz_crc32(m_crc, m_dict.data() + m_pendingStart, count));
+                m_pendingStart += count;
+                m_pendingSize -= count;
+                total += count;
+            }
+            m_position += total;
+            return total;
+        }
+
+        void skip(uint64_t count) override
+        {
+            std::array<char, 4096> scratch = {};
+            while(count > 0)
+            {
+                size_t n = read(scratch.data(), std::min<uint64_t>(count, scratch.size()));
+                if(n == 0)
+                    break;
+                count -= n;
+            }
+        }
+
+        [[nodiscard]] uint64_t size() const override { return m_size; }
+        [[nodiscard]] uint64_t tell() const override { return m_position; }
+
+    private:
+
+        void verify(size_t pending)
+        {
+            // Bytes were already handed out, a bad entry can only be reported by throwing
+            if(m_verified)
+                return;
+            m_verified = true;
+            const bool complete = m_status == TINFL_STATUS_DONE && m_position + pending == m_size;
+            if(!complete || (m_expectedCrc && *m_expectedCrc != m_crc))
+                throw std::runtime_error("Corrupted deflate stream");
+        }
+
+        Blob m_input;
+        uint64_t m_size = 0;
+        std::optional<uint32_t> m_expectedCrc;
+        uint32_t m_crc = MZ_CRC32_INIT;
+        bool m_verified = false;
+        uint64_t m_position = 0;
+        size_t m_inputPos = 0;
+        tinfl_decompressor m_inflator = {};
+        tinfl_status m_status = TINFL_STATUS_HAS_MORE_OUTPUT;
+        std::vector<mz_uint8> m_dict;
+        size_t m_dictPos = 0;
+        size_t m_pendingStart = 0;
+        size_t m_pendingSize = 0;
+    };
+
+    class StdFileStream : public IFileStream
+    {
+    public:
+
+        explicit StdFileStream(const fs::path& path)
+        {
+            #ifdef _WIN32
+            m_file.open(path, std::ios::in | std::ios::binary);
+            if(!m_file)
+                throw std::runtime_error("File Not Found: " + path.string());
+            m_size = fs::file_size(path);
+            #else
+            m_fd = open(path.c_str(), O_RDONLY);
+            struct stat st = {};
+            if(m_fd < 0 || fstat(m_fd, &st) != 0)
+                throw std::runtime_error("File Not Found: " + path.string());
+            m_size = static_cast<uint64_t>(st.st_size);
+            posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            #endif
+        }
+
+        ~StdFileStream() override
+        {
+            #ifndef _WIN32
+            if(m_fd >= 0)
+                close(m_fd);
+            #endif
+        }
+
+        size_t read(char* dst, size_t size) override
+        {
+            size = std::min<uint64_t>(size, m_size - m_position);
+            size_t done = 0;
+            #ifdef _WIN32
+            m_file.seekg(static_cast<std::streamoff>(m_position));
+            m_file.read(dst, static_cast<std::streamsize>(size));
+            done = static_cast<size_t>(m_file.gcount());
+            #else
+            while(done < size)
+            {
+                ssize_t n = pread(m_fd, dst + done, size - done, static_cast<off_t>(m_position + done));
+                if(n < 0 && errno == EINTR)
+                    continue;
+                if(n <= 0)
+                    break;
+                done += static_cast<size_t>(n);
+            }
+            #endif
+            m_position += done;
+            return done;
+        }
+
+        void skip(uint64_t count) override { m_position = std::min(m_position + count, m_size); }
+        [[nodiscard]] uint64_t size() const override { return m_size; }
+        [[nodiscard]] uint64_t tell() const override { return m_position; }
+
+    private:
+
+        #ifdef _WIN32
+        std::ifstream m_file;
+        #else
+        int m_fd = -1;
+        #endif
+        uint64_t m_size = 0;
+        uint64_t m_position = 0;
+    };
+
+    static Blob readStreamRange(IFileStream& stream, uint64_t offset, uint64_t size)
+    {
+        if(offset >= stream.size())
+            return {};
+
+        size = std::min(size, stream.size() - offset);
+        stream.skip(offset);
+        Blob blob = Blob::allocate(size);
+        if(stream.read(blob.mutableData(), size) != size)
+            return {};
+        return blob;
+    }
+
+    Blob IFileSystem::readRange(const fs::path& path, uint64_t offset, uint64_t size)
+    {
+        Blob blob = readFile(path);
+        if(offset >= blob.size())
+            return {};
+        return blob.slice(offset, std::min(size, blob.size() - offset));
+    }
+
+    FileStreamPtr IFileSystem::openStream(const fs::path& path)
+    {
+        return std::make_unique<BlobStream>(readFile(path));
+    }
+
+    MainQueue& MainQueue::Get()
+    {
+        static MainQueue queue;
+        return std::ref(queue);
+    }
+
+    void MainQueue::post(std::function<void()> task)
+    {
+        std::lock_guard lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+
+    void MainQueue::drain()
+    {
+        // Tasks posted while draining wait for the next frame
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard lock(m_mutex);
+            tasks.swap(m_tasks);
+        }
+        for(auto& task : tasks)
+            task();
+    }
+
+    void ReadFileAwaitable::await_suspend(std::coroutine_handle<> handle)
+    {
+        // The completion may run on the io_uring thread, hand the rest of the coroutine to the pool
+        FileSystemService::Get().readFileAsync(m_path, [this, handle](Blob blob, std::exception_ptr error){
+            m_blob = std::move(blob);
+            m_error = std::move(error);
+            Async::GetPool().push_task([handle](){ handle.resume(); });
+        });
+    }
+
+    Blob ReadFileAwaitable::await_resume()
+    {
+        if(m_error)
+            std::rethrow_exception(m_error);
+        return std::move(m_blob);
+    }
+
+    std::future<Blob> IFileSystem::readFileAsync(const fs::path& path)
+    {
+        return Async::GetPool().submit([this, path](){ return readFile(path); });
+    }
+
+    void IFileSystem::readFileAsync(const fs::path& path, ReadCallback callback)
+    {
+        Async::GetPool().push_task([this, path, callback = std::move(callback)](){
+            Blob blob;
+            std::exception_ptr error;
+            try
+            {
+                blob = readFile(path);
+            }
+            catch(...)
+            {
+                error = std::current_exception();
+            }
+            callback(std::move(blob), std::move(error));
+        });
+    }
+
+    std::vector<std::future<Blob>> IFileSystem::readFiles(std::span<const fs::path> paths)
+    {
+        std::vector<std::future<Blob>> futures;
+        futures.reserve(paths.size());
+        for(const auto& path : paths)
+            futures.emplace_back(readFileAsync(path));
+        return futures;
+    }
+
     StdFileSystem::StdFileSystem(const fs::path& root) : m_root(root.lexically_normal())
     {
 
@@ -60,162 +481,740 @@ namespace ler
             throw std::runtime_error("File Not Found: " + ec.message());
 
         // Create a buffer.
-        Blob result(sz);
-        //auto blob = std::make_shared<Blobi>();
-        //blob->data.resize(sz);
+        Blob result = Blob::allocate(sz);
 
         // Read the whole file into the buffer.
-        f.read(result.data(), sz);
-        //f.read(blob->data.data(), sz);
+        f.read(result.mutableData(), sz);
 
         return result;
     }
 
-    void StdFileSystem::enumerates(std::vector<fs::path>& entries)
+    Blob StdFileSystem::mapFile(const fs::path& path)
     {
+        return Blob::map(m_root / path);
+    }
+
+    Blob StdFileSystem::readRange(const fs::path& path, uint64_t offset, uint64_t size)
+    {
+        StdFileStream stream(m_root / path);
+        return readStreamRange(stream, offset, size);
+    }
+
+    FileStreamPtr StdFileSystem::openStream(const fs::path& path)
+    {
+        // Missing files give nullptr like the archive backends, other failures still throw
+        std::error_code ec;
+        if(!fs::is_regular_file(m_root / path, ec))
+            return nullptr;
+        return std::make_unique<StdFileStream>(m_root / path);
+    }
+
+    void StdFileSystem::enumerates(std::vector<FileEntry>& entries)
+    {
+        std::error_code ec;
         for(const auto& entry : fs::recursive_directory_iterator(m_root))
         {
             std::string spath = entry.path().lexically_normal().generic_string();
             std::string relative = spath.substr(m_root.string().size() + 1);
             if(entry.is_regular_file())
-                entries.emplace_back(relative);
+                entries.push_back({ relative, entry.file_size(ec), entry.last_write_time(ec) });
         }
     }
 
+    std::optional<FileEntry> StdFileSystem::stat(const fs::path& path)
+    {
+        std::error_code ec;
+        const fs::path name = m_root / path;
+        if(!fs::is_regular_file(name, ec))
+            return {};
+        return FileEntry{ path, fs::file_size(name, ec), fs::last_write_time(name, ec) };
+    }
+
     fs::file_time_type StdFileSystem::last_write_time(const fs::path& path)
     {
-        return fs::last_write_time(path);
+        return fs::last_write_time(m_root / path);
     }
 
-    /*std::future<Blob> StdFileSystem::readFileAsync(const fs::path& path)
+    std::vector<std::future<Blob>> StdFileSystem::readFiles(std::span<const fs::path> paths)
     {
-        return Async::GetPool().submit([](){
-            Blob res;
-            return res;
+        // Inode order approximates on-disk order on most file systems
+        return readSorted(this, paths, [this](const fs::path& path) -> uint64_t {
+            #ifdef _WIN32
+            return 0;
+            #else
+            struct stat st = {};
+            if(::stat((m_root / path).c_str(), &st) != 0)
+                return 0;
+            return st.st_ino;
+            #endif
         });
-    }*/
+    }
+
+#ifdef LER_HAS_IO_URING
+    FileSystemPtr UringFileSystem::Create(const fs::path& root)
+    {
+        auto ring = std::make_unique<io_uring>();
+        int res = io_uring_queue_init(c_queueDepth, ring.get(), 0);
+        if(res < 0)
+        {
+            log::warn("io_uring unavailable ({}), using blocking reads", strerror(-res));
+            return StdFileSystem::Create(root);
+        }
+        return std::make_shared<UringFileSystem>(root, std::move(ring));
+    }
+
+    UringFileSystem::UringFileSystem(const fs::path& root, std::unique_ptr<io_uring> ring) : StdFileSystem(root), m_ring(std::move(ring))
+    {
+        m_thread = std::thread(&UringFileSystem::run, this);
+    }
+
+    UringFileSystem::~UringFileSystem()
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_thread.join();
+        io_uring_queue_exit(m_ring.get());
+    }
+
+    std::future<Blob> UringFileSystem::readFileAsync(const fs::path& path)
+    {
+        std::future<Blob> future;
+        {
+            std::lock_guard lock(m_mutex);
+            auto& request = m_queue.emplace_back();
+            request.path = m_root / path;
+            future = request.promise.get_future();
+        }
+        m_cond.notify_one();
+        return future;
+    }
+
+    void UringFileSystem::readFileAsync(const fs::path& path, ReadCallback callback)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            auto& request = m_queue.emplace_back();
+            request.path = m_root / path;
+            request.callback = std::move(callback);
+        }
+        m_cond.notify_one();
+    }
 
-    ZipFileSystem::~ZipFileSystem()
+    std::vector<std::future<Blob>> UringFileSystem::readFiles(std::span<const fs::path> paths)
     {
-        if (m_zipArchive)
+        // The kernel orders the queue itself, submit the whole batch at once
+        std::vector<std::future<Blob>> futures;
+        futures.reserve(paths.size());
         {
-            mz_zip_reader_end((mz_zip_archive*)m_zipArchive);
-            free(m_zipArchive);
-            m_zipArchive = nullptr;
+            std::lock_guard lock(m_mutex);
+            for(const auto& path : paths)
+            {
+                auto& request = m_queue.emplace_back();
+                request.path = m_root / path;
+                futures.emplace_back(request.promise.get_future());
+            }
+        }
+        m_cond.notify_one();
+        return futures;
+    }
+
+    void UringFileSystem::start(Request& request, std::deque<Chunk>& chunks)
+    {
+        request.fd = open(request.path.c_str(), O_RDONLY);
+        struct stat st = {};
+        if(request.fd < 0 || fstat(request.fd, &st) != 0)
+        {
+            request.error = errno;
+            return;
+        }
+
+        // Large files are split so that a single file still fills the queue
+        auto size = static_cast<uint64_t>(st.st_size);
+        request.blob = Blob::allocate(size);
+        request.remaining = size;
+        for(uint64_t offset = 0; offset < size; offset += c_chunkSize)
+            chunks.push_back({ &request, offset, static_cast<uint32_t>(std::min<uint64_t>(c_chunkSize, size - offset)) });
+    }
+
+    void UringFileSystem::finish(Request& request)
+    {
+        if(request.fd >= 0)
+            close(request.fd);
+
+        std::exception_ptr error;
+        if(request.error)
+            error = std::make_exception_ptr(std::runtime_error("File Not Found: " + request.path.string() + " (" + strerror(request.error) + ")"));
+
+        if(request.callback)
+            request.callback(error ? Blob() : std::move(request.blob), error);
+        else if(error)
+            request.promise.set_exception(error);
+        else
+            request.promise.set_value(std::move(request.blob));
+    }
+
+    void UringFileSystem::run()
+    {
+        std::list<Request> active;
+        std::deque<Chunk> chunks;
+        uint32_t inflight = 0;
+        uint32_t opened = 0;
+
+        auto complete = [&](std::list<Request>::iterator it){
+            if(it->fd >= 0)
+                opened--;
+            finish(*it);
+            return active.erase(it);
+        };
+
+        while(true)
+        {
+            {
+                std::unique_lock lock(m_mutex);
+                if(active.empty())
+                    m_cond.wait(lock, [this](){ return m_stop || !m_queue.empty(); });
+                if(m_stop && m_queue.empty() && active.empty())
+                    break;
+                active.splice(active.end(), m_queue);
+            }
+
+            // Open new requests, empty or failed ones complete immediately
+            // Requests start in order, the ones past the limit wait unopened so that a huge batch
+            // holds neither thousands of descriptors nor all of its buffers at once
+            for(auto it = active.begin(); it != active.end();)
+            {
+                if(it->fd < 0 && it->error == 0)
+                {
+                    if(opened >= c_maxOpen)
+                        break;
+                    start(*it, chunks);
+                    if(it->fd >= 0)
+                        opened++;
+                }
+                if(it->error || it->remaining == 0)
+                    it = complete(it);
+                else
+                    ++it;
+            }
+
+            // Keep the submission queue full
+            while(!chunks.empty() && inflight < c_queueDepth)
+            {
+                io_uring_sqe* sqe = io_uring_get_sqe(m_ring.get());
+                if(sqe == nullptr)
+                    break;
+                auto* chunk = new Chunk(chunks.front());
+                chunks.pop_front();
+                io_uring_prep_read(sqe, chunk->request->fd, chunk->request->blob.mutableData() + chunk->offset, chunk->size, chunk->offset);
+                io_uring_sqe_set_data(sqe, chunk);
+                chunk->request->inflight++;
+                inflight++;
+            }
+
+            if(inflight == 0)
+                continue;
+
+            io_uring_submit_and_wait(m_ring.get(), 1);
+
+            unsigned head;
+            unsigned count = 0;
+            io_uring_cqe* cqe;
+            io_uring_for_each_cqe(m_ring.get(), head, cqe)
+            {
+                count++;
+                inflight--;
+                std::unique_ptr<Chunk> chunk(static_cast<Chunk*>(io_uring_cqe_get_data(cqe)));
+                Request& request = *chunk->request;
+                request.inflight--;
+                if(cqe->res < 0)
+                {
+                    request.error = -cqe->res;
+                }
+                else if(cqe->res == 0)
+                {
+                    request.error = EIO;
+                }
+                else if(static_cast<uint32_t>(cqe->res) < chunk->size)
+                {
+                    // Short read, queue the rest of the chunk again
+                    auto done = static_cast<uint32_t>(cqe->res);
+                    request.remaining -= done;
+                    chunks.push_front({ &request, chunk->offset + done, chunk->size - done });
+                }
+                else
+                {
+                    request.remaining -= chunk->size;
+                }
+            }
+            io_uring_cq_advance(m_ring.get(), count);
+
+            // Drop the queued chunks of failed requests, they complete once their reads in flight return
+            std::erase_if(chunks, [](const Chunk& c){ return c.request->error != 0; });
+            for(auto it = active.begin(); it != active.end();)
+            {
+                if(it->remaining == 0 || (it->error && it->inflight == 0))
+                    it = complete(it);
+                else
+                    ++it;
+            }
         }
     }
+#endif
 
-    ZipFileSystem::ZipFileSystem(const fs::path& path)
+    static std::string normalizeZipPath(const fs::path& path)
     {
-        auto m_ArchivePath = path.lexically_normal().generic_string();
+        return path.lexically_normal().relative_path().generic_string();
+    }
+
+    ZipFileSystem::~ZipFileSystem() = default;
 
-        m_zipArchive = malloc(sizeof(mz_zip_archive));
-        memset(m_zipArchive, 0, sizeof(mz_zip_archive));
+    ZipFileSystem::ZipFileSystem(const fs::path& path) : m_arena(std::make_shared<std::pmr::synchronized_pool_resource>())
+    {
+        try
+        {
+            m_archive = Blob::map(path);
+        }
+        catch(const std::exception& e)
+        {
+            log::warn(e.what());
+            return;
+        }
 
-        if (!mz_zip_reader_init_file((mz_zip_archive*)m_zipArchive, m_ArchivePath.c_str(),
-            MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY | MZ_ZIP_FLAG_VALIDATE_HEADERS_ONLY))
+        // Parse the central directory once, reads then only touch the mapped archive
+        mz_zip_archive zip = {};
+        if (!mz_zip_reader_init_mem(&zip, m_archive.data(), m_archive.size(), MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY))
         {
-            const char* errorString = mz_zip_get_error_string(mz_zip_get_last_error((mz_zip_archive*)m_zipArchive));
+            const char* errorString = mz_zip_get_error_string(mz_zip_get_last_error(&zip));
             log::warn(errorString);
+            return;
         }
 
-        mz_uint numFiles = mz_zip_reader_get_num_files((mz_zip_archive*)m_zipArchive);
+        mz_uint numFiles = mz_zip_reader_get_num_files(&zip);
+        m_files.reserve(numFiles);
         for (mz_uint i = 0; i < numFiles; i++)
         {
-            mz_uint nameLength = mz_zip_reader_get_filename((mz_zip_archive*)m_zipArchive, i, nullptr, 0);
-            std::string name;
-            name.resize(nameLength - 1); // exclude the trailing zero
-            mz_zip_reader_get_filename((mz_zip_archive*)m_zipArchive, i, name.data(), nameLength);
+            mz_zip_archive_file_stat stat;
+            if (!mz_zip_reader_file_stat(&zip, i, &stat) || stat.m_is_directory)
+                continue;
+
+            if (stat.m_is_encrypted || !stat.m_is_supported)
+            {
+                log::warn("Skip unsupported zip entry {}", stat.m_filename);
+                continue;
+            }
 
-            if (!mz_zip_reader_is_file_a_directory((mz_zip_archive*)m_zipArchive, i))
-                m_files[name] = i;
+            ZipEntry entry;
+            entry.localHeader = stat.m_local_header_ofs;
+            entry.compressedSize = stat.m_comp_size;
+            entry.size = stat.m_uncomp_size;
+            entry.method = stat.m_method;
+            entry.crc = stat.m_crc32;
+            entry.time = std::chrono::clock_cast<std::chrono::file_clock>(std::chrono::system_clock::from_time_t(stat.m_time));
+            m_files.emplace(stat.m_filename, entry);
         }
+
+        mz_zip_reader_end(&zip);
     }
 
     bool ZipFileSystem::exists(const fs::path& path) const
     {
-        return m_files.contains(path);
+        return m_files.contains(normalizeZipPath(path));
     }
 
-    Blob ZipFileSystem::readFile(const fs::path& path)
+    Blob ZipFileSystem::rawData(const std::string& name, const ZipEntry& entry) const
     {
-        std::string normalizedName = path.lexically_normal().relative_path().generic_string();
+        // The local header has variable length name and extra fields before the data
+        constexpr uint64_t localHeaderSize = 30;
+        if (entry.localHeader + localHeaderSize > m_archive.size())
+            return {};
 
-        if (normalizedName.empty())
+        const auto* header = reinterpret_cast<const unsigned char*>(m_archive.data() + entry.localHeader);
+        uint64_t nameLength = header[26] | (header[27] << 8);
+        uint64_t extraLength = header[28] | (header[29] << 8);
+        uint64_t offset = entry.localHeader + localHeaderSize + nameLength + extraLength;
+        if (offset + entry.compressedSize > m_archive.size())
+        {
+            log::warn("Truncated zip entry {}", name);
             return {};
+        }
 
-        auto entry = m_files.find(normalizedName);
-        if (entry == m_files.end())
+        if (entry.method != 0 && entry.method != MZ_DEFLATED)
+        {
+            log::warn("Unsupported zip compression for {}", name);
             return {};
+        }
 
-        uint32_t fileIndex = entry->second;
+        return m_archive.slice(offset, entry.compressedSize);
+    }
 
-        // working with the archive from now on, requires synchronous access
-        std::lock_guard<std::mutex> lockGuard(m_mutex);
+    Blob ZipFileSystem::readFile(const fs::path& path)
+    {
+        auto it = m_files.find(normalizeZipPath(path));
+        if (it == m_files.end() || it->second.size == 0)
+            return {};
+
+        const ZipEntry& entry = it->second;
+        Blob raw = rawData(it->first, entry);
+        if (raw.empty())
+            return {};
 
-        // get information about the file, including its uncompressed size
-        mz_zip_archive_file_stat stat;
-        if (!mz_zip_reader_file_stat((mz_zip_archive*)m_zipArchive, fileIndex , &stat))
+        // Stored entries are served straight from the mapping
+        if (entry.method == 0)
+            return raw;
+
+        Blob uncompressedData = Blob::allocate(entry.size, m_arena);
+        size_t written = tinfl_decompress_mem_to_mem(uncompressedData.mutableData(), entry.size, raw.data(), raw.size(), 0);
+        if (written != entry.size || mz_crc32(MZ_CRC32_INIT, reinterpret_cast<const mz_uint8*>(uncompressedData.data()), entry.size) != entry.crc)
         {
-            const char* errorString = mz_zip_get_error_string(mz_zip_get_last_error((mz_zip_archive*)m_zipArchive));
-            log::warn(errorString);
+            log::warn("Corrupted zip entry {}", it->first);
+            return {};
+        }
+
+        return uncompressedData;
+    }
+
+    Blob ZipFileSystem::readRange(const fs::path& path, uint64_t offset, uint64_t size)
+    {
+        auto it = m_files.find(normalizeZipPath(path));
+        if (it == m_files.end() || offset >= it->second.size)
+            return {};
+
+        Blob raw = rawData(it->first, it->second);
+        if (raw.empty())
+            return {};
+
+        if (it->second.method == 0)
+            return raw.slice(offset, std::min(size, raw.size() - offset));
+
+        InflateStream stream(raw, it->second.size);
+        return readStreamRange(stream, offset, size);
+    }
+
+    FileStreamPtr ZipFileSystem::openStream(const fs::path& path)
+    {
+        auto it = m_files.find(normalizeZipPath(path));
+        if (it == m_files.end())
+            return nullptr;
+
+        Blob raw = rawData(it->first, it->second);
+        if (it->second.method == 0 || raw.empty())
+            return std::make_unique<BlobStream>(raw);
+        return std::make_unique<InflateStream>(raw, it->second.size, it->second.crc);
+    }
+
+    void ZipFileSystem::enumerates(std::vector<FileEntry>& entries)
+    {
+        for(const auto& [name, entry] : m_files)
+            entries.push_back({ name, entry.size, entry.time });
+    }
+
+    std::optional<FileEntry> ZipFileSystem::stat(const fs::path& path)
+    {
+        auto it = m_files.find(normalizeZipPath(path));
+        if (it == m_files.end())
             return {};
+        return FileEntry{ it->first, it->second.size, it->second.time };
+    }
+
+    fs::file_time_type ZipFileSystem::last_write_time(const fs::path& path)
+    {
+        auto it = m_files.find(normalizeZipPath(path));
+        if (it == m_files.end())
+            return {};
+        return it->second.time;
+    }
+
+    std::vector<std::future<Blob>> ZipFileSystem::readFiles(std::span<const fs::path> paths)
+    {
+        // Walk the archive front to back
+        return readSorted(this, paths, [this](const fs::path& path) -> uint64_t {
+            auto it = m_files.find(normalizeZipPath(path));
+            return it == m_files.end() ? 0 : it->second.localHeader;
+        });
+    }
+
+    PakFileSystem::PakFileSystem(const fs::path& path) : m_arena(std::make_shared<std::pmr::synchronized_pool_resource>())
+    {
+        try
+        {
+            m_archive = Blob::map(path);
+        }
+        catch(const std::exception& e)
+        {
+            log::warn(e.what());
+            return;
         }
 
-        if (stat.m_uncomp_size == 0)
+        PakHeader header;
+        if(m_archive.size() < sizeof(PakHeader))
+            return;
+        std::memcpy(&header, m_archive.data(), sizeof(PakHeader));
+        const uint64_t archiveSize = m_archive.size();
+        auto within = [](uint64_t offset, uint64_t size, uint64_t limit){ return offset <= limit && size <= limit - offset; };
+        if(header.magic != c_magic || header.version != c_version || header.tocOffset % alignof(PakEntry) != 0 ||
+           !within(header.tocOffset, static_cast<uint64_t>(header.entryCount) * sizeof(PakEntry), archiveSize) ||
+           !within(header.namesOffset, header.namesSize, archiveSize))
+        {
+            log::warn("Invalid pak archive {}", path.string());
+            return;
+        }
+
+        // Reads trust the table of contents, reject the whole archive on any entry out of bounds
+        auto toc = reinterpret_cast<const PakEntry*>(m_archive.data() + header.tocOffset);
+        std::span<const PakEntry> entries(toc, header.entryCount);
+        for(size_t i = 0; i < entries.size(); ++i)
+        {
+            const auto& entry = entries[i];
+            bool valid = within(entry.offset, entry.storedSize, archiveSize) && within(entry.nameOffset, entry.nameLength, header.namesSize);
+            if(!(entry.flags & c_deflated))
+                valid = valid && entry.size == entry.storedSize;
+            if(i > 0)
+                valid = valid && entries[i-1].hash <= entry.hash;
+            if(!valid)
+            {
+                log::warn("Invalid pak archive {}, corrupted entry {}", path.string(), i);
+                return;
+            }
+        }
+
+        m_toc = entries;
+        m_names = { m_archive.data() + header.namesOffset, header.namesSize };
+    }
+
+    std::string_view PakFileSystem::name(const PakEntry& entry) const
+    {
+        return m_names.substr(entry.nameOffset, entry.nameLength);
+    }
+
+    const PakFileSystem::PakEntry* PakFileSystem::find(const fs::path& path) const
+    {
+        std::string key = normalizeZipPath(path);
+        uint64_t hash = hashBytes(key.data(), key.size());
+        auto it = std::ranges::lower_bound(m_toc, hash, {}, &PakEntry::hash);
+        for(; it != m_toc.end() && it->hash == hash; ++it)
+        {
+            if(name(*it) == key)
+                return &*it;
+        }
+        return nullptr;
+    }
+
+    bool PakFileSystem::exists(const fs::path& path) const
+    {
+        return find(path) != nullptr;
+    }
+
+    Blob PakFileSystem::readFile(const fs::path& path)
+    {
+        const PakEntry* entry = find(path);
+        if(entry == nullptr || entry->size == 0)
             return {};
 
-        // extract the file
-        Blob uncompressedData(stat.m_uncomp_size);
-        if (!mz_zip_reader_extract_to_mem((mz_zip_archive*)m_zipArchive, fileIndex, uncompressedData.data(), stat.m_uncomp_size, 0))
+        // Stored entries are served straight from the mapping
+        if((entry->flags & c_deflated) == 0)
+            return m_archive.slice(entry->offset, entry->size);
+
+        Blob data = Blob::allocate(entry->size, m_arena);
+        size_t written = tinfl_decompress_mem_to_mem(data.mutableData(), entry->size, m_archive.data() + entry->offset, entry->storedSize, 0);
+        if(written != entry->size)
         {
-            const char* errorString = mz_zip_get_error_string(mz_zip_get_last_error((mz_zip_archive*)m_zipArchive));
-            log::warn(errorString);
+            log::warn("Corrupted pak entry {}", name(*entry));
             return {};
         }
+        return data;
+    }
 
-        return uncompressedData;
+    Blob PakFileSystem::readRange(const fs::path& path, uint64_t offset, uint64_t size)
+    {
+        const PakEntry* entry = find(path);
+        if(entry == nullptr || offset >= entry->size)
+            return {};
+
+        Blob raw = m_archive.slice(entry->offset, entry->storedSize);
+        if((entry->flags & c_deflated) == 0)
+            return raw.slice(offset, std::min(size, entry->size - offset));
+
+        InflateStream stream(raw, entry->size);
+        return readStreamRange(stream, offset, size);
     }
 
-    void ZipFileSystem::enumerates(std::vector<fs::path>& entries)
+    FileStreamPtr PakFileSystem::openStream(const fs::path& path)
     {
-        for(const auto& entry : m_files)
-            entries.emplace_back(entry.first);
+        const PakEntry* entry = find(path);
+        if(entry == nullptr)
+            return nullptr;
+
+        Blob raw = m_archive.slice(entry->offset, entry->storedSize);
+        if((entry->flags & c_deflated) == 0)
+            return std::make_unique<BlobStream>(raw);
+        return std::make_unique<InflateStream>(raw, entry->size);
     }
 
-    fs::file_time_type ZipFileSystem::last_write_time(const fs::path& path)
+    void PakFileSystem::enumerates(std::vector<FileEntry>& entries)
     {
-        std::string normalizedName = path.lexically_normal().relative_path().generic_string();
+        for(const auto& entry : m_toc)
+            entries.push_back({ name(entry), entry.size, fs::file_time_type(fs::file_time_type::duration(entry.time)) });
+    }
 
-        if (normalizedName.empty())
+    std::optional<FileEntry> PakFileSystem::stat(const fs::path& path)
+    {
+        const PakEntry* entry = find(path);
+        if(entry == nullptr)
             return {};
+        return FileEntry{ name(*entry), entry->size, fs::file_time_type(fs::file_time_type::duration(entry->time)) };
+    }
 
-        auto entry = m_files.find(normalizedName);
-        if (entry == m_files.end())
+    fs::file_time_type PakFileSystem::last_write_time(const fs::path& path)
+    {
+        const PakEntry* entry = find(path);
+        if(entry == nullptr)
             return {};
+        return fs::file_time_type(fs::file_time_type::duration(entry->time));
+    }
 
-        uint32_t fileIndex = entry->second;
+    std::vector<std::future<Blob>> PakFileSystem::readFiles(std::span<const fs::path> paths)
+    {
+        return readSorted(this, paths, [this](const fs::path& path) -> uint64_t {
+            const PakEntry* entry = find(path);
+            return entry ? entry->offset : 0;
+        });
+    }
 
-        // working with the archive from now on, requires synchronous access
-        std::lock_guard<std::mutex> lockGuard(m_mutex);
+    void PakFileSystem::pack(const fs::path& output, IFileSystem& source)
+    {
+        std::vector<FileEntry> files;
+        source.enumerates(files);
 
-        // get information about the file, including its uncompressed size
-        mz_zip_archive_file_stat stat;
-        if (!mz_zip_reader_file_stat((mz_zip_archive*)m_zipArchive, fileIndex , &stat))
+        std::ofstream file(output, std::ios::out | std::ios::binary | std::ios::trunc);
+        if(!file)
+            throw std::runtime_error("Can't write pak archive: " + output.string());
+
+        auto align = [&file](){
+            auto pos = static_cast<uint64_t>(file.tellp());
+            uint64_t padded = (pos + c_alignment - 1) / c_alignment * c_alignment;
+            std::fill_n(std::ostreambuf_iterator<char>(file), padded - pos, '\0');
+            return padded;
+        };
+
+        // Header is written last, data starts at the first aligned page
+        std::string names;
+        std::vector<PakEntry> toc;
+        toc.reserve(files.size());
+        std::fill_n(std::ostreambuf_iterator<char>(file), sizeof(PakHeader), '\0');
+        for(const auto& f : files)
         {
-            const char* errorString = mz_zip_get_error_string(mz_zip_get_last_error((mz_zip_archive*)m_zipArchive));
-            log::warn(errorString);
-            return {};
+            // Per-machine caches and interrupted writes have nothing to do in a shipped archive
+            const auto filename = f.path.filename();
+            if(filename == "pipeline.cache" || filename == "shaders.manifest" || filename.extension() == ".tmp")
+                continue;
+
+            std::string key = normalizeZipPath(f.path);
+            auto blob = source.readFile(f.path);
+
+            PakEntry entry;
+            entry.hash = hashBytes(key.data(), key.size());
+            entry.offset = align();
+            entry.size = blob.size();
+            entry.storedSize = blob.size();
+            entry.time = f.time.time_since_epoch().count();
+            entry.nameOffset = static_cast<uint32_t>(names.size());
+            entry.nameLength = static_cast<uint32_t>(key.size());
+            names += key;
+
+            // Keep compression only when it saves at least an eighth
+            size_t compressedSize = 0;
+            void* compressed = blob.empty() ? nullptr : tdefl_compress_mem_to_heap(blob.data(), blob.size(), &compressedSize, TDEFL_DEFAULT_MAX_PROBES);
+            if(compressed && compressedSize < blob.size() - blob.size() / 8)
+            {
+                entry.flags |= c_deflated;
+                entry.storedSize = compressedSize;
+                file.write(static_cast<const char*>(compressed), static_cast<std::streamsize>(compressedSize));
+            }
+            else
+            {
+                file.write(blob.data(), static_cast<std::streamsize>(blob.size()));
+            }
+            mz_free(compressed);
+
+            log::info("Pack {} ({} -> {} bytes)", key, entry.size, entry.storedSize);
+            toc.push_back(entry);
         }
 
-        return std::chrono::clock_cast<std::chrono::file_clock>(std::chrono::system_clock::from_time_t(stat.m_time));
+        std::sort(toc.begin(), toc.end(), [](const PakEntry& a, const PakEntry& b){ return a.hash < b.hash; });
+
+        PakHeader header;
+        header.magic = c_magic;
+        header.version = c_version;
+        header.entryCount = static_cast<uint32_t>(toc.size());
+        header.alignment = c_alignment;
+        header.tocOffset = align();
+        file.write(reinterpret_cast<const char*>(toc.data()), static_cast<std::streamsize>(toc.size() * sizeof(PakEntry)));
+        header.namesOffset = static_cast<uint64_t>(file.tellp());
+        header.namesSize = names.size();
+        file.write(names.data(), static_cast<std::streamsize>(names.size()));
+
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(PakHeader));
+        if(!file)
+            throw std::runtime_error("Failed to write pak archive: " + output.string());
     }
 
-    //std::future<Blob> ZipFileSystem::readFileAsync(const fs::path &path) {return {}; }
+    std::string FileSystemService::normalize(const fs::path& path)
+    {
+        return path.lexically_normal().relative_path().generic_string();
+    }
+
+    void FileSystemService::indexMount(uint32_t mount)
+    {
+        // Earlier mounts take precedence, emplace keeps their entries
+        std::vector<FileEntry> entries;
+        m_mountPoints[mount]->enumerates(entries);
+        m_index.reserve(m_index.size() + entries.size());
+        for(const auto& entry : entries)
+            m_index.emplace(normalize(entry.path), IndexEntry{ mount, entry.size, entry.time });
+    }
 
     void FileSystemService::mount(const FileSystemPtr& fs)
     {
+        std::unique_lock lock(m_mutex);
         m_mountPoints.emplace_back(fs);
+        indexMount(static_cast<uint32_t>(m_mountPoints.size() - 1));
+    }
+
+    void FileSystemService::refresh()
+    {
+        std::unique_lock lock(m_mutex);
+        m_index.clear();
+        for(uint32_t i = 0; i < m_mountPoints.size(); ++i)
+            indexMount(i);
+    }
+
+    void FileSystemService::invalidate(const fs::path& path)
+    {
+        std::unique_lock lock(m_mutex);
+        std::string key = normalize(path);
+        m_index.erase(key);
+        for(uint32_t i = 0; i < m_mountPoints.size(); ++i)
+        {
+            auto entry = m_mountPoints[i]->stat(key);
+            if(entry.has_value())
+            {
+                m_index.emplace(key, IndexEntry{ i, entry->size, entry->time });
+                break;
+            }
+        }
+    }
+
+    FileSystemPtr FileSystemService::resolve(const std::string& key) const
+    {
+        std::shared_lock lock(m_mutex);
+        auto it = m_index.find(key);
+        if(it == m_index.end())
+            return nullptr;
+        return m_mountPoints[it->second.mount];
     }
 
     FileSystemService& FileSystemService::Get()
@@ -226,32 +1225,233 @@ namespace ler
 
     bool FileSystemService::exists(const fs::path& path) const
     {
-        return std::ranges::any_of(m_mountPoints, [path](auto& fs){ return fs->exists(path); });
+        std::shared_lock lock(m_mutex);
+        return m_index.contains(normalize(path));
     }
 
     Blob FileSystemService::readFile(const fs::path& path)
     {
-        for(auto& fs : m_mountPoints)
+        FileSystemPtr mount;
+        std::string key = normalize(path);
         {
-            if(fs->exists(path))
-                return fs->readFile(path);
+            std::shared_lock lock(m_mutex);
+            auto it = m_index.find(key);
+            if(it == m_index.end())
+                return {};
+            mount = m_mountPoints[it->second.mount];
         }
-        return {};
+        return mount->readFile(key);
     }
 
-    void FileSystemService::enumerates(std::vector<fs::path>& entries)
+    Blob FileSystemService::mapFile(const fs::path& path)
     {
-        for(auto& fs : m_mountPoints)
-            fs->enumerates(entries);
+        FileSystemPtr mount;
+        std::string key = normalize(path);
+        {
+            std::shared_lock lock(m_mutex);
+            auto it = m_index.find(key);
+            if(it == m_index.end())
+                return {};
+            mount = m_mountPoints[it->second.mount];
+        }
+        return mount->mapFile(key);
+    }
+
+    Blob FileSystemService::readRange(const fs::path& path, uint64_t offset, uint64_t size)
+    {
+        std::string key = normalize(path);
+        auto mount = resolve(key);
+        return mount ? mount->readRange(key, offset, size) : Blob();
+    }
+
+    FileStreamPtr FileSystemService::openStream(const fs::path& path)
+    {
+        std::string key = normalize(path);
+        auto mount = resolve(key);
+        return mount ? mount->openStream(key) : nullptr;
+    }
+
+    std::future<Blob> FileSystemService::readFileAsync(const fs::path& path)
+    {
+        FileSystemPtr mount;
+        std::string key = normalize(path);
+        {
+            std::shared_lock lock(m_mutex);
+            auto it = m_index.find(key);
+            if(it == m_index.end())
+                return readyBlob();
+            mount = m_mountPoints[it->second.mount];
+        }
+        return mount->readFileAsync(key);
+    }
+
+    void FileSystemService::readFileAsync(const fs::path& path, ReadCallback callback)
+    {
+        FileSystemPtr mount;
+        std::string key = normalize(path);
+        {
+            std::shared_lock lock(m_mutex);
+            auto it = m_index.find(key);
+            if(it != m_index.end())
+                mount = m_mountPoints[it->second.mount];
+        }
+        // Unknown paths complete with an empty blob, like the future based read
+        if(!mount)
+            callback({}, nullptr);
+        else
+            mount->readFileAsync(key, std::move(callback));
+    }
+
+    std::vector<std::future<Blob>> FileSystemService::readFiles(std::span<const fs::path> paths)
+    {
+        // Split the batch per mount so each backend orders its own reads
+        std::vector<std::future<Blob>> futures(paths.size());
+        std::vector<std::vector<fs::path>> batches;
+        std::vector<std::vector<size_t>> slots;
+        std::vector<FileSystemPtr> mounts;
+        {
+            std::shared_lock lock(m_mutex);
+            mounts = m_mountPoints;
+            batches.resize(m_mountPoints.size());
+            slots.resize(m_mountPoints.size());
+            for(size_t i = 0; i < paths.size(); ++i)
+            {
+                std::string key = normalize(paths[i]);
+                auto it = m_index.find(key);
+                if(it == m_index.end())
+                {
+                    futures[i] = readyBlob();
+                    continue;
+                }
+                batches[it->second.mount].emplace_back(key);
+                slots[it->second.mount].push_back(i);
+            }
+        }
+
+        for(size_t m = 0; m < batches.size(); ++m)
+        {
+            if(batches[m].empty())
+                continue;
+            auto results = mounts[m]->readFiles(batches[m]);
+            for(size_t j = 0; j < results.size(); ++j)
+                futures[slots[m][j]] = std::move(results[j]);
+        }
+        return futures;
+    }
+
+    void FileSystemService::enumerates(std::vector<FileEntry>& entries)
+    {
+        std::shared_lock lock(m_mutex);
+        entries.reserve(entries.size() + m_index.size());
+        for(const auto& [name, entry] : m_index)
+            entries.push_back({ name, entry.size, entry.time });
+    }
+
+    std::optional<FileEntry> FileSystemService::stat(const fs::path& path)
+    {
+        std::shared_lock lock(m_mutex);
+        auto it = m_index.find(normalize(path));
+        if(it == m_index.end())
+            return {};
+        return FileEntry{ it->first, it->second.size, it->second.time };
     }
 
     fs::file_time_type FileSystemService::last_write_time(const fs::path& path)
     {
-        for(auto& fs : m_mountPoints)
+        std::shared_lock lock(m_mutex);
+        auto it = m_index.find(normalize(path));
+        if(it == m_index.end())
+            return {};
+        return it->second.time;
+    }
+
+    FileWatcher::FileWatcher()
+    {
+    #ifdef __linux__
+        m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(m_fd < 0)
+            log::warn("Failed to create inotify instance: {}", std::strerror(errno));
+    #endif
+    }
+
+    FileWatcher::~FileWatcher()
+    {
+    #ifdef __linux__
+        if(m_fd >= 0)
+            close(m_fd);
+    #endif
+    }
+
+    void FileWatcher::watch(const fs::path& root)
+    {
+        addDirectory(root, fs::path());
+    }
+
+    void FileWatcher::addDirectory(const fs::path& root, const fs::path& relative)
+    {
+    #ifdef __linux__
+        if(m_fd < 0)
+            return;
+
+        const fs::path dir = root / relative;
+        const uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+        int wd = inotify_add_watch(m_fd, dir.c_str(), mask);
+        if(wd < 0)
         {
-            if(fs->exists(path))
-                return fs->last_write_time(path);
+            log::warn("Failed to watch {}: {}", dir.string(), std::strerror(errno));
+            return;
         }
-        return {};
+        m_watches[wd] = { root, relative };
+
+        // inotify is not recursive, every subdirectory needs its own watch
+        std::error_code ec;
+        for(const auto& entry : fs::directory_iterator(dir, ec))
+        {
+            if(entry.is_directory(ec))
+                addDirectory(root, relative / entry.path().filename());
+        }
+    #endif
+    }
+
+    std::vector<fs::path> FileWatcher::poll(std::chrono::milliseconds quiet)
+    {
+    #ifdef __linux__
+        alignas(inotify_event) char buffer[4096];
+        ssize_t len;
+        while(m_fd >= 0 && (len = read(m_fd, buffer, sizeof(buffer))) > 0)
+        {
+            const inotify_event* event;
+            for(char* ptr = buffer; ptr < buffer + len; ptr += sizeof(inotify_event) + event->len)
+            {
+                event = reinterpret_cast<const inotify_event*>(ptr);
+                if(event->mask & IN_Q_OVERFLOW)
+                    log::warn("File watcher queue overflow, some changes were lost");
+
+                auto it = m_watches.find(event->wd);
+                if(event->mask & IN_IGNORED)
+                {
+                    if(it != m_watches.end())
+                        m_watches.erase(it);
+                    continue;
+                }
+                if(it == m_watches.end() || event->len == 0)
+                    continue;
+
+                m_lastEvent = std::chrono::steady_clock::now();
+                fs::path relative = it->second.relative / event->name;
+                if(!(event->mask & IN_ISDIR))
+                    m_changed.insert(relative);
+                else if(event->mask & (IN_CREATE | IN_MOVED_TO))
+                    addDirectory(fs::path(it->second.root), relative);
+            }
+        }
+    #endif
+
+        if(m_changed.empty() || std::chrono::steady_clock::now() - m_lastEvent < quiet)
+            return {};
+
+        std::vector<fs::path> changed(m_changed.begin(), m_changed.end());
+        m_changed.clear();
+        return changed;
     }
 }
@@ -6,17 +6,33 @@
 #define LER_SYS_H
 
 #include "common.hpp"
+#include <atomic>
 #include <concepts>
 #include <coroutine>
 #include <exception>
+#include <chrono>
+#include <cassert>
 #include <BS_thread_pool.hpp>
 
+#ifdef LER_HAS_IO_URING
+#include <thread>
+#include <condition_variable>
+struct io_uring;
+#endif
+
 namespace ler
 {
     static const fs::path ASSETS_DIR = fs::path(PROJECT_DIR) / "assets";
     static const fs::path CACHED_DIR = fs::path("cached");
-    static constexpr uint32_t C50Mio = 50 * 1024 * 1024;
+    static const fs::path PAK_FILE = fs::path("assets.pak");
     std::string getHomeDir();
+    uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull);
+
+    template <typename T>
+    void hashCombine(uint64_t& seed, const T& value)
+    {
+        seed ^= std::hash<T>{}(value) + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+    }
 
     class Async
     {
@@ -33,67 +49,224 @@ namespace ler
         BS::thread_pool m_pool;
     };
 
-    enum class BlobKind
+    class MappedFile
     {
-        Image,
-        Scene,
-        Shader
+    public:
+
+        explicit MappedFile(const fs::path& path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        [[nodiscard]] const char* data() const { return m_data; }
+        [[nodiscard]] size_t size() const { return m_size; }
+
+    private:
+
+        const char* m_data = nullptr;
+        size_t m_size = 0;
+    #ifdef _WIN32
+        void* m_file = nullptr;
+        void* m_mapping = nullptr;
+    #endif
     };
 
-    struct Blobi
+    // Shared byte buffer, never zero-initialized
+    // The storage is owned by a heap array, a file mapping or a memory resource
+    // Copies share the storage, mapped blobs are read-only and refuse mutableData()
+    class Blob
     {
-        using allocator_type = std::pmr::polymorphic_allocator<char>;
-        explicit Blobi(allocator_type alloc = {}) : path(alloc), data(alloc) {}
-        Blobi(const Blobi& blob, const allocator_type& alloc) : path(blob.path, alloc), data(blob.data, alloc) {}
-        Blobi(Blobi&& blob, const allocator_type& alloc) : path(std::move(blob.path), alloc), data(std::move(blob.data), alloc) {}
+    public:
 
-        std::pmr::string path;
-        std::pmr::vector<char> data;
-        fs::file_time_type time;
-        BlobKind kind = BlobKind::Shader;
+        Blob() = default;
+        Blob(std::shared_ptr<void> owner, char* data, size_t size, bool readOnly = false) : m_owner(std::move(owner)), m_data(data), m_size(size), m_readOnly(readOnly) {}
+
+        static Blob allocate(size_t size);
+        static Blob allocate(size_t size, std::shared_ptr<std::pmr::memory_resource> resource);
+        static Blob map(const fs::path& path);
+
+        [[nodiscard]] Blob slice(size_t offset, size_t size) const { return { m_owner, m_data + offset, size, m_readOnly }; }
+
+        [[nodiscard]] char* mutableData() { assert(!m_readOnly); return m_readOnly ? nullptr : m_data; }
+        [[nodiscard]] const char* data() const { return m_data; }
+        [[nodiscard]] bool readOnly() const { return m_readOnly; }
+        [[nodiscard]] size_t size() const { return m_size; }
+        [[nodiscard]] bool empty() const { return m_size == 0; }
+        [[nodiscard]] const char* begin() const { return m_data; }
+        [[nodiscard]] const char* end() const { return m_data + m_size; }
+        operator std::span<const char>() const { return { m_data, m_size }; }
+
+    private:
+
+        std::shared_ptr<void> m_owner;
+        char* m_data = nullptr;
+        size_t m_size = 0;
+        bool m_readOnly = false;
     };
 
-    using Blob = std::vector<char>;
-    //using Blob = std::shared_ptr<Blobi>;
+    // Continuations that must touch ImGui or the frame, drained once per frame by LerApp::run
+    class MainQueue
+    {
+    public:
+
+        static MainQueue& Get();
+        void post(std::function<void()> task);
+        void drain();
 
+    private:
+
+        std::mutex m_mutex;
+        std::vector<std::function<void()>> m_tasks;
+    };
+
+    struct ResumeOnMainThread
+    {
+        [[nodiscard]] bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) const { MainQueue::Get().post([handle](){ handle.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+
+    struct ResumeOnPool
+    {
+        [[nodiscard]] bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) const { Async::GetPool().push_task([handle](){ handle.resume(); }); }
+        void await_resume() const noexcept {}
+    };
+
+    // Eager task: runs on the caller thread until its first suspension
+    // The frame outlives the AsyncRes when it is dropped before completion
     template <typename T>
     class AsyncRes
     {
     public:
         struct promise_type
         {
-            T result;
-            std::future<Blob> awaiter;
+            std::optional<T> result;
+            std::exception_ptr error;
+            std::coroutine_handle<> continuation;
+            std::atomic<bool> finished = false;
+            // The last of the awaiter and the final suspend to arrive resumes the continuation
+            std::atomic<bool> handoff = false;
+            // Task object and running coroutine, the last one to let go destroys the frame
+            std::atomic<int> owners = 2;
+
             AsyncRes get_return_object() { return AsyncRes(handle_type::from_promise(*this)); }
-            std::suspend_never initial_suspend() { return {}; }
-            std::suspend_always final_suspend() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            auto final_suspend() noexcept
+            {
+                struct FinalAwaiter
+                {
+                    [[nodiscard]] bool await_ready() const noexcept { return false; }
+                    std::coroutine_handle<> await_suspend(handle_type h) noexcept
+                    {
+                        auto& promise = h.promise();
+                        promise.finished = true;
+                        promise.finished.notify_all();
+                        std::coroutine_handle<> next = std::noop_coroutine();
+                        if(promise.handoff.exchange(true))
+                            next = promise.continuation;
+                        if(promise.owners.fetch_sub(1) == 1)
+                            h.destroy();
+                        return next;
+                    }
+                    void await_resume() const noexcept {}
+                };
+                return FinalAwaiter();
+            }
             void return_value(T res) noexcept
             {
                 result = std::move(res);
             }
-            void unhandled_exception() {}
+            void unhandled_exception()
+            {
+                error = std::current_exception();
+            }
+            T value()
+            {
+                if(error)
+                    std::rethrow_exception(error);
+                return *result;
+            }
         };
         using handle_type = std::coroutine_handle<promise_type>;
         explicit AsyncRes(handle_type h) : handle(h) {}
-        [[nodiscard]] bool loaded() const { return handle.done(); }
-        void wait() { handle.promise().awaiter.wait(); }
-        ~AsyncRes() { handle.destroy(); }
+        AsyncRes(AsyncRes&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+        AsyncRes(const AsyncRes&) = delete;
+        AsyncRes& operator=(const AsyncRes&) = delete;
+        ~AsyncRes()
+        {
+            if(handle && handle.promise().owners.fetch_sub(1) == 1)
+                handle.destroy();
+        }
+
+        [[nodiscard]] bool loaded() const { return handle.promise().finished; }
+        void wait() const { handle.promise().finished.wait(false); }
+        T get() { wait(); return handle.promise().value(); }
+
+        auto operator co_await() noexcept
+        {
+            struct Awaiter
+            {
+                handle_type handle;
+                [[nodiscard]] bool await_ready() const noexcept { return handle.promise().finished; }
+                bool await_suspend(std::coroutine_handle<> h) noexcept
+                {
+                    handle.promise().continuation = h;
+                    return !handle.promise().handoff.exchange(true);
+                }
+                T await_resume() { return handle.promise().value(); }
+            };
+            return Awaiter{ handle };
+        }
 
     private:
         handle_type handle;
     };
 
+    struct FileEntry
+    {
+        fs::path path;
+        uint64_t size = 0;
+        fs::file_time_type time;
+    };
+
+    class IFileStream
+    {
+    public:
+
+        virtual ~IFileStream() = default;
+        // Returns the number of bytes read, less than size only at the end of the file
+        virtual size_t read(char* dst, size_t size) = 0;
+        virtual void skip(uint64_t count) = 0;
+        [[nodiscard]] virtual uint64_t size() const = 0;
+        [[nodiscard]] virtual uint64_t tell() const = 0;
+        [[nodiscard]] bool eof() const { return tell() >= size(); }
+    };
+
+    using FileStreamPtr = std::unique_ptr<IFileStream>;
+    // Receives the blob, or the error of the read, on the thread that completed it
+    using ReadCallback = std::function<void(Blob, std::exception_ptr)>;
+
     class IFileSystem
     {
     public:
 
         virtual ~IFileSystem() = default;
         virtual Blob readFile(const fs::path& path) = 0;
+        virtual Blob mapFile(const fs::path& path) { return readFile(path); }
+        // Range is clamped to the end of the file
+        virtual Blob readRange(const fs::path& path, uint64_t offset, uint64_t size);
+        virtual FileStreamPtr openStream(const fs::path& path);
         [[nodiscard]] virtual bool exists(const fs::path& path) const = 0;
-        virtual void enumerates(std::vector<fs::path>& entries) = 0;
+        virtual void enumerates(std::vector<FileEntry>& entries) = 0;
+        [[nodiscard]] virtual std::optional<FileEntry> stat(const fs::path& path) = 0;
         [[nodiscard]] virtual fs::file_time_type last_write_time(const fs::path& path) = 0;
-        //virtual std::future<Blob> readFileAsync(const fs::path& path) = 0;
-        //virtual TaskBlob readFileAwaitable(const fs::path& path) = 0;
+        virtual std::future<Blob> readFileAsync(const fs::path& path);
+        // Completion style read, the callback must not block
+        virtual void readFileAsync(const fs::path& path, ReadCallback callback);
+        // Futures are returned in the order of the paths, backends may reorder the reads
+        virtual std::vector<std::future<Blob>> readFiles(std::span<const fs::path> paths);
     };
 
     using FileSystemPtr = std::shared_ptr<IFileSystem>;
@@ -112,17 +285,74 @@ namespace ler
 
         explicit StdFileSystem(const fs::path& root);
         Blob readFile(const fs::path& path) override;
+        Blob mapFile(const fs::path& path) override;
+        Blob readRange(const fs::path& path, uint64_t offset, uint64_t size) override;
+        FileStreamPtr openStream(const fs::path& path) override;
         [[nodiscard]] bool exists(const fs::path& path) const override;
-        void enumerates(std::vector<fs::path>& entries) override;
+        void enumerates(std::vector<FileEntry>& entries) override;
+        [[nodiscard]] std::optional<FileEntry> stat(const fs::path& path) override;
         [[nodiscard]] fs::file_time_type last_write_time(const fs::path& path) override;
-        //std::future<Blob> readFileAsync(const fs::path& path) override;
+        std::vector<std::future<Blob>> readFiles(std::span<const fs::path> paths) override;
         //static FileSystemPtr Create(const fs::path& path) { return std::make_shared<StdFileSystem>(path); }
 
-    private:
+    protected:
 
         fs::path m_root;
     };
 
+#ifdef LER_HAS_IO_URING
+    // Keeps a deep queue of reads in flight on a dedicated io_uring thread
+    // Create() falls back to StdFileSystem when the kernel refuses the ring
+    class UringFileSystem : public StdFileSystem
+    {
+    public:
+
+        ~UringFileSystem() override;
+        UringFileSystem(const fs::path& root, std::unique_ptr<io_uring> ring);
+        static FileSystemPtr Create(const fs::path& root);
+
+        std::future<Blob> readFileAsync(const fs::path& path) override;
+        void readFileAsync(const fs::path& path, ReadCallback callback) override;
+        std::vector<std::future<Blob>> readFiles(std::span<const fs::path> paths) override;
+
+    private:
+
+        struct Request
+        {
+            fs::path path;
+            std::promise<Blob> promise;
+            ReadCallback callback;
+            Blob blob;
+            int fd = -1;
+            uint64_t remaining = 0;
+            uint32_t inflight = 0;
+            int error = 0;
+        };
+
+        struct Chunk
+        {
+            Request* request = nullptr;
+            uint64_t offset = 0;
+            uint32_t size = 0;
+        };
+
+        void run();
+        void start(Request& request, std::deque<Chunk>& chunks);
+        void finish(Request& request);
+
+        static constexpr uint32_t c_queueDepth = 64;
+        static constexpr uint32_t c_chunkSize = 1048576;
+        static constexpr uint32_t c_maxOpen = 4 * c_queueDepth;
+
+        std::unique_ptr<io_uring> m_ring;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+        std::list<Request> m_queue;
+        bool m_stop = false;
+        std::thread m_thread;
+    };
+#endif
+
     class ZipFileSystem : public FileSystem<ZipFileSystem>
     {
     public:
@@ -130,17 +360,90 @@ namespace ler
         ~ZipFileSystem() override;
         explicit ZipFileSystem(const fs::path& path);
         Blob readFile(const fs::path& path) override;
+        Blob readRange(const fs::path& path, uint64_t offset, uint64_t size) override;
+        FileStreamPtr openStream(const fs::path& path) override;
         [[nodiscard]] bool exists(const fs::path& path) const override;
-        void enumerates(std::vector<fs::path>& entries) override;
+        void enumerates(std::vector<FileEntry>& entries) override;
+        [[nodiscard]] std::optional<FileEntry> stat(const fs::path& path) override;
         [[nodiscard]] fs::file_time_type last_write_time(const fs::path& path) override;
-        //std::future<Blob> readFileAsync(const fs::path& path) override;
+        std::vector<std::future<Blob>> readFiles(std::span<const fs::path> paths) override;
         //static FileSystemPtr Create(const fs::path& path) { return std::make_shared<ZipFileSystem>(path); }
 
     private:
 
-        std::mutex m_mutex;
-        void* m_zipArchive = nullptr;
-        std::unordered_map<fs::path, uint32_t> m_files;
+        struct ZipEntry
+        {
+            uint64_t localHeader = 0;
+            uint64_t compressedSize = 0;
+            uint64_t size = 0;
+            uint32_t method = 0;
+            uint32_t crc = 0;
+            fs::file_time_type time;
+        };
+
+        [[nodiscard]] Blob rawData(const std::string& name, const ZipEntry& entry) const;
+
+        Blob m_archive;
+        std::shared_ptr<std::pmr::memory_resource> m_arena;
+        std::unordered_map<std::string, ZipEntry> m_files;
+    };
+
+    // Packed archive: 4 KiB aligned entries, optionally deflated
+    // The table of contents is sorted by path hash and read in place from the mapping
+    class PakFileSystem : public FileSystem<PakFileSystem>
+    {
+    public:
+
+        explicit PakFileSystem(const fs::path& path);
+        static void pack(const fs::path& output, IFileSystem& source);
+
+        Blob readFile(const fs::path& path) override;
+        Blob readRange(const fs::path& path, uint64_t offset, uint64_t size) override;
+        FileStreamPtr openStream(const fs::path& path) override;
+        [[nodiscard]] bool exists(const fs::path& path) const override;
+        void enumerates(std::vector<FileEntry>& entries) override;
+        [[nodiscard]] std::optional<FileEntry> stat(const fs::path& path) override;
+        [[nodiscard]] fs::file_time_type last_write_time(const fs::path& path) override;
+        std::vector<std::future<Blob>> readFiles(std::span<const fs::path> paths) override;
+
+    private:
+
+        struct PakHeader
+        {
+            uint32_t magic = 0;
+            uint32_t version = 0;
+            uint32_t entryCount = 0;
+            uint32_t alignment = 0;
+            uint64_t tocOffset = 0;
+            uint64_t namesOffset = 0;
+            uint64_t namesSize = 0;
+        };
+
+        struct PakEntry
+        {
+            uint64_t hash = 0;
+            uint64_t offset = 0;
+            uint64_t size = 0;
+            uint64_t storedSize = 0;
+            int64_t time = 0;
+            uint32_t nameOffset = 0;
+            uint32_t nameLength = 0;
+            uint32_t flags = 0;
+            uint32_t padding = 0;
+        };
+
+        static constexpr uint32_t c_magic = 0x4B41504C; // 'LPAK'
+        static constexpr uint32_t c_version = 1;
+        static constexpr uint32_t c_alignment = 4096;
+        static constexpr uint32_t c_deflated = 1;
+
+        [[nodiscard]] const PakEntry* find(const fs::path& path) const;
+        [[nodiscard]] std::string_view name(const PakEntry& entry) const;
+
+        Blob m_archive;
+        std::span<const PakEntry> m_toc;
+        std::string_view m_names;
+        std::shared_ptr<std::pmr::memory_resource> m_arena;
     };
 
     class FileSystemService : public IFileSystem
@@ -148,39 +451,89 @@ namespace ler
     public:
 
         void mount(const FileSystemPtr& fs);
+        void refresh();
+        void invalidate(const fs::path& path);
         static FileSystemService& Get();
 
         Blob readFile(const fs::path& path) override;
+        Blob mapFile(const fs::path& path) override;
+        Blob readRange(const fs::path& path, uint64_t offset, uint64_t size) override;
+        FileStreamPtr openStream(const fs::path& path) override;
         [[nodiscard]] bool exists(const fs::path& path) const override;
-        void enumerates(std::vector<fs::path>& entries) override;
+        void enumerates(std::vector<FileEntry>& entries) override;
+        [[nodiscard]] std::optional<FileEntry> stat(const fs::path& path) override;
         [[nodiscard]] fs::file_time_type last_write_time(const fs::path& path) override;
-        //std::future<Blob> readFileAsync(const fs::path& path) override;
+        std::future<Blob> readFileAsync(const fs::path& path) override;
+        void readFileAsync(const fs::path& path, ReadCallback callback) override;
+        std::vector<std::future<Blob>> readFiles(std::span<const fs::path> paths) override;
 
     private:
 
+        struct IndexEntry
+        {
+            uint32_t mount = 0;
+            uint64_t size = 0;
+            fs::file_time_type time;
+        };
+
+        static std::string normalize(const fs::path& path);
+        void indexMount(uint32_t mount);
+        FileSystemPtr resolve(const std::string& key) const;
+
+        // Normalized path to the first mount providing it
+        mutable std::shared_mutex m_mutex;
         std::vector<FileSystemPtr> m_mountPoints;
-        std::byte Buffer[C50Mio];
-        std::pmr::monotonic_buffer_resource m_pool;
+        std::unordered_map<std::string, IndexEntry> m_index;
     };
 
-    class ReadFileAwaitable
+    // Polled from the main loop, reports paths relative to their watched root
+    // Events are coalesced until the tree stays quiet, editors often save in several steps
+    // Only implemented with inotify, poll() never reports anything elsewhere
+    class FileWatcher
     {
     public:
 
-        auto operator co_await()
+        FileWatcher();
+        ~FileWatcher();
+
+        FileWatcher(const FileWatcher&) = delete;
+        FileWatcher& operator=(const FileWatcher&) = delete;
+
+        void watch(const fs::path& root);
+        std::vector<fs::path> poll(std::chrono::milliseconds quiet = std::chrono::milliseconds(200));
+
+    private:
+
+        struct Watch
         {
-            struct Awaiter
-            {
-                std::coroutine_handle<>* hp_;
-                constexpr bool await_ready() const noexcept { return false; }
-                void await_suspend(std::coroutine_handle<> h)
-                {
+            fs::path root;
+            fs::path relative;
+        };
 
-                }
-                constexpr void await_resume() const noexcept {}
-            };
-            return Awaiter();
-        }
+        void addDirectory(const fs::path& root, const fs::path& relative);
+
+        int m_fd = -1;
+        std::unordered_map<int, Watch> m_watches;
+        std::set<fs::path> m_changed;
+        std::chrono::steady_clock::time_point m_lastEvent;
+    };
+
+    // Reads through the FileSystemService, the coroutine resumes on the thread pool with the blob
+    // No thread waits for the read, the backend completion schedules the resume
+    class ReadFileAwaitable
+    {
+    public:
+
+        explicit ReadFileAwaitable(fs::path path) : m_path(std::move(path)) {}
+        [[nodiscard]] bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        Blob await_resume();
+
+    private:
+
+        fs::path m_path;
+        Blob m_blob;
+        std::exception_ptr m_error;
     };
 }
 
@@ -6,16 +6,33 @@ int main()
 {
     ler::log::set_level(ler::log::level::level_enum::debug);
     ler::GlslangInitializer initme;
+
+    // Mount default directories, loose files take precedence over the packed archive
+    fs::create_directory(ler::CACHED_DIR);
+    if(fs::exists(ler::ASSETS_DIR))
+    {
+#ifdef LER_HAS_IO_URING
+        ler::FileSystemService::Get().mount(ler::UringFileSystem::Create(ler::ASSETS_DIR));
+#else
+        ler::FileSystemService::Get().mount(ler::StdFileSystem::Create(ler::ASSETS_DIR));
+#endif
+    }
+    ler::FileSystemService::Get().mount(ler::StdFileSystem::Create(ler::CACHED_DIR));
+    if(fs::exists(ler::PAK_FILE))
+        ler::FileSystemService::Get().mount(ler::PakFileSystem::Create(ler::PAK_FILE));
     ler::shaderAutoCompile();
 
+    // Loose assets are reloaded while the editor runs
+    ler::FileWatcher watcher;
+    if(fs::exists(ler::ASSETS_DIR))
+        watcher.watch(ler::ASSETS_DIR);
+
     ler::LerApp app;
     auto dev = app.getDevice();
 
-    // TODO: finish async cache
-    bool toto;
-    ler::CacheLoader cache;
-    auto co = cache.load("test.png", dev);
-    toto = co.loaded();
+    ler::CacheLoader cache(dev);
+    dev->addEvictor([&cache](uint64_t bytes){ return cache.trim(bytes); });
+    auto texture = cache.load("test.png");
     ler::BatchedMesh batch;
     batch.allocate(dev);
     batch.appendMeshFromFile(dev, "Bolt.fbx");
@@ -33,6 +50,17 @@ int main()
     bool p_open = true;
     app.show([&](){
 
+        auto changed = watcher.poll();
+        if(!changed.empty())
+        {
+            auto& fs = ler::FileSystemService::Get();
+            for(const auto& path : changed)
+                fs.invalidate(path);
+            dev->reloadShaders(ler::shaderRecompile(changed));
+            for(const auto& path : changed)
+                batch.reloadMeshFromFile(dev, path);
+        }
+
         /*ImGuiWindowFlags window_flags = ImGuiWindowFlags_MenuBar | ImGuiWindowFlags_NoDocking;
         const ImGuiViewport* viewport = ImGui::GetMainViewport();
         ImGui::SetNextWindowPos(viewport->WorkPos);
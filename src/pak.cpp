@@ -0,0 +1,41 @@
+//
+// Created by loulfy on 17/10/2026.
+//
+
+#include "ler_sys.hpp"
+#include "ler_spv.hpp"
+#include "ler_log.hpp"
+
+// Usage: lerpak [output] [directories...]
+// Compiles the shaders, then packs the directories into one archive, earlier directories win
+int main(int argc, char** argv)
+{
+    fs::path output = argc > 1 ? fs::path(argv[1]) : ler::PAK_FILE;
+    std::vector<fs::path> roots;
+    for(int i = 2; i < argc; ++i)
+        roots.emplace_back(argv[i]);
+    if(roots.empty())
+        roots = { ler::ASSETS_DIR, ler::CACHED_DIR };
+
+    ler::GlslangInitializer initme;
+    fs::create_directory(ler::CACHED_DIR);
+    auto& service = ler::FileSystemService::Get();
+    for(const auto& root : roots)
+        service.mount(ler::StdFileSystem::Create(root));
+    if(std::ranges::find(roots, ler::CACHED_DIR) == roots.end())
+        service.mount(ler::StdFileSystem::Create(ler::CACHED_DIR));
+    ler::shaderAutoCompile();
+
+    try
+    {
+        ler::PakFileSystem::pack(output, service);
+    }
+    catch(const std::exception& e)
+    {
+        ler::log::error(e.what());
+        return EXIT_FAILURE;
+    }
+
+    ler::log::info("Packed {}", output.string());
+    return EXIT_SUCCESS;
+}